@@ -12,16 +12,18 @@
 Main Components:
 1. Registry Manipulation: Modifies StuckRects3 registry values to control
    taskbar behavior
-2. Explorer Process Handling: Kills and restarts explorer.exe to apply changes
+2. Explorer Process Handling: Applies the change to the live shell through
+   the AppBar API, and only kills and restarts explorer.exe when that fails
 3. Window State Preservation: Tracks and restores open Explorer windows
 4. Foreground App Preservation: Remembers and restores focused application
 5. System Tray Integration: Optional tray mode for persistent access
 
 Key Functions:
 - ExecuteToggleAction(): Main orchestration function
-- ToggleTaskbarSetting(): Registry manipulation
+- ToggleTaskbarSettingLive(): Restart-free toggle through SHAppBarMessage
+- ToggleTaskbarSetting(): Registry manipulation (primary and per-monitor blobs)
 - GetOpenExplorerWindows() / RestoreExplorerWindows(): Window state handling
-- GetForegroundAppInfo() / RestoreForegroundApp(): Focus preservation
+- CaptureDesktopSnapshot() / RestoreDesktopSnapshot(): Z-order and focus preservation
 */
 #include "resource.h" 
 #include "framework.h"
@@ -31,717 +33,3659 @@ Key Functions:
 #include <vector>
 #include <string>
 #include <ShlObj.h>
-#include <TlHelp32.h>
 #include <atlbase.h>
 #include <shellapi.h>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <unordered_map>
+#include <exdispid.h>
 #include <Psapi.h>
 #include <strsafe.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#include <CommCtrl.h>
+#include <cstdio>
+#include <WtsApi32.h>
+#include <sddl.h>
+
+// LoadIconWithScaleDown lives in Common Controls 6.
+#pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "wtsapi32.lib")
+#pragma comment(linker, "\"/manifestdependency:type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 
 
 #define TRAY_MODE true
 #define WM_TRAYICON (WM_USER + 1)
+#define WM_TASKBARSTATECHANGED (WM_USER + 2)
+#define WM_TOGGLEPROGRESS (WM_USER + 3)
+// Sent to Shell_TrayWnd, this is the "Exit Explorer" command of the taskbar's
+// Ctrl+Shift context menu: the shell saves its state and exits cleanly.
+#define WM_SHELL_EXIT (WM_USER + 436)
+#define TOGGLE_PROGRESS_STARTED 0
+#define TOGGLE_PROGRESS_FINISHED 1
+#define WM_SHELLSTARTING (WM_USER + 4)
+#define WM_SHELLEXITED (WM_USER + 5)
+#define WM_EXPLORERINDEXCHANGED (WM_USER + 6)
 #define ID_TRAY_EXIT 1001
+#define ID_TRAY_REOPEN_HELD 1003
+#define ID_TRAY_STATISTICS 1004
 #define TASKBAR_ALWAYS_VISIBLE 0x02
 #define TASKBAR_AUTOHIDE 0x03
+// Process exit codes of --status, --enable and --disable
+#define EXIT_TASKBAR_ALWAYS_VISIBLE 0
+#define EXIT_TASKBAR_AUTOHIDE 1
+#define EXIT_TASKBAR_FAILED 2
 
 /*
- * These structs store information about Explorer windows and foreground
- * applications to preserve state when restarting Explorer
+ * Single instance: the tray instance owns INSTANCE_MUTEX_NAME, and other
+ * launches hand their command to its window with WM_COPYDATA. Every toggle,
+ * in any process, runs under TOGGLE_MUTEX_NAME.
  */
-struct ExplorerWindow {
-    std::wstring path;
-    RECT position;
-    WINDOWPLACEMENT placement;
-    HWND hwnd;
-    HWND focusedHwnd;
-    DWORD zOrder;
+#define INSTANCE_MUTEX_NAME L"Local\\ToggleTaskbarAutohide.Instance"
+#define TOGGLE_MUTEX_NAME L"Local\\ToggleTaskbarAutohide.Toggle"
+#define WINDOW_CLASS_NAME L"ToggleTaskbarAutohideClass"
+#define COPYDATA_TOGGLE_COMMAND 0x54544131
+#define FORWARD_COMMAND_TIMEOUT_MS 2000
+
+/*
+ * Per-stage timeouts for the restart pipeline. Each stage waits on a real
+ * signal and returns as soon as it fires; these only bound the worst case.
+ */
+#define FOLDER_CLOSE_TIMEOUT_MS 1000
+#define SHELL_GRACEFUL_EXIT_TIMEOUT_MS 3000
+#define SHELL_EXIT_TIMEOUT_MS 5000
+#define SHELL_TRAYWND_TIMEOUT_MS 10000
+#define SHELL_TASKBARCREATED_TIMEOUT_MS 5000
+#define SHELL_INPUTIDLE_TIMEOUT_MS 5000
+#define FOLDER_WINDOW_TIMEOUT_MS 5000
+#define SHELL_START_ATTEMPTS 3
+#define SHELL_START_RETRY_MS 1000
+
+/*
+ * --allsessions: how many session shells restart at once by default
+ * (--maxparallel=N overrides it), and how long one may take to come back.
+ */
+#define SESSION_DEFAULT_PARALLEL 4
+#define SESSION_MAX_PARALLEL 64
+#define SESSION_SHELL_RESTART_TIMEOUT_MS 10000
+#define SESSION_SHELL_POLL_MS 100
+
+// Scratch memory shared by the capture and restore code of one toggle
+#define TOGGLE_ARENA_SIZE (256 * 1024)
+#define TOGGLE_ARENA_ALIGNMENT 16
+// Pages are committed in steps of this size as the arena fills
+#define TOGGLE_ARENA_COMMIT_STEP (16 * 1024)
+
+/*
+ * ExplorerWindow and the desktop snapshot types (see ToggleTaskbarAutohide.h)
+ * store information about Explorer windows and foreground applications to
+ * preserve state when restarting Explorer
+ */
+struct DesktopWindowKeyHash {
+    size_t operator()(const DesktopWindowKey& key) const {
+        return ((size_t)key.processId * 16777619u) ^ ((size_t)key.classHash * 31u) ^ (size_t)key.titleHash;
+    }
 };
 
-struct ForegroundAppInfo {
-    HWND hwnd;
-    DWORD processId;
-    std::wstring executablePath;
-    std::wstring windowTitle;
-    WINDOWPLACEMENT placement;
+/*
+ * Toggle Arena:
+ * The lookup tables built while matching windows live only as long as one
+ * capture or restore. They are carved out of a single block instead of
+ * costing a heap allocation per window. The block is reserved the first
+ * time it is needed and committed as it fills; when the outermost
+ * ArenaScope on the owning thread ends - once per toggle - it is rewound
+ * and decommitted, so a resident process keeps no scratch pages between
+ * toggles. Requests that do not fit, or that come from another thread
+ * while the arena is taken, go to ::operator new, where the benchmark's
+ * allocation count sees them.
+ */
+struct ToggleArena {
+    BYTE* base;
+    size_t used;
+    size_t committed;
+    volatile LONG owner;
+    LONG depth;
+};
+
+ToggleArena g_toggleArena = {};
+
+class ArenaScope {
+public:
+    ArenaScope() : m_owned(false) {
+        LONG thread = (LONG)GetCurrentThreadId();
+        LONG owner = InterlockedCompareExchange(&g_toggleArena.owner, thread, 0);
+        if (owner != 0 && owner != thread) return;
+        if (!g_toggleArena.base) {
+            g_toggleArena.base = (BYTE*)VirtualAlloc(NULL, TOGGLE_ARENA_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+        }
+        g_toggleArena.depth++;
+        m_owned = true;
+    }
+
+    ~ArenaScope() {
+        if (!m_owned || --g_toggleArena.depth > 0) return;
+        if (g_toggleArena.committed) VirtualFree(g_toggleArena.base, g_toggleArena.committed, MEM_DECOMMIT);
+        g_toggleArena.committed = 0;
+        g_toggleArena.used = 0;
+        InterlockedExchange(&g_toggleArena.owner, 0);
+    }
+
+private:
+    bool m_owned;
+};
+
+// Commits the pages the next size bytes need; false leaves them to the heap.
+bool CommitArena(size_t size) {
+    size_t end = g_toggleArena.used + size;
+    if (end <= g_toggleArena.committed) return true;
+    size_t commit = (end + TOGGLE_ARENA_COMMIT_STEP - 1) & ~(size_t)(TOGGLE_ARENA_COMMIT_STEP - 1);
+    if (commit > TOGGLE_ARENA_SIZE) commit = TOGGLE_ARENA_SIZE;
+    if (!VirtualAlloc(g_toggleArena.base + g_toggleArena.committed, commit - g_toggleArena.committed,
+        MEM_COMMIT, PAGE_READWRITE)) {
+        return false;
+    }
+    g_toggleArena.committed = commit;
+    return true;
+}
+
+void* ArenaAllocate(size_t size) {
+    size_t rounded = (size + TOGGLE_ARENA_ALIGNMENT - 1) & ~(size_t)(TOGGLE_ARENA_ALIGNMENT - 1);
+    if (rounded >= size && g_toggleArena.base && g_toggleArena.owner == (LONG)GetCurrentThreadId() &&
+        TOGGLE_ARENA_SIZE - g_toggleArena.used >= rounded && CommitArena(rounded)) {
+        void* block = g_toggleArena.base + g_toggleArena.used;
+        g_toggleArena.used += rounded;
+        return block;
+    }
+    return ::operator new(size);
+}
+
+void ArenaFree(void* block) {
+    BYTE* bytes = (BYTE*)block;
+    if (g_toggleArena.base && bytes >= g_toggleArena.base && bytes < g_toggleArena.base + TOGGLE_ARENA_SIZE) return;
+    ::operator delete(block);
+}
+
+// Allocator for containers that do not outlive the enclosing ArenaScope
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator() {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        if (count > (size_t)-1 / sizeof(T)) throw std::bad_alloc();
+        return (T*)ArenaAllocate(count * sizeof(T));
+    }
+    void deallocate(T* block, size_t) { ArenaFree(block); }
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return false; }
+
+typedef std::vector<HWND, ArenaAllocator<HWND> > ArenaWindowList;
+typedef std::unordered_map<DesktopWindowKey, HWND, DesktopWindowKeyHash, std::equal_to<DesktopWindowKey>,
+    ArenaAllocator<std::pair<const DesktopWindowKey, HWND> > > DesktopWindowIndex;
+
+const char* const g_stageNames[STAGE_COUNT] = {
+    "Toggle",
+    "LiveToggle",
+    "SnapshotForeground",
+    "SnapshotExplorer",
+    "RegistryWrite",
+    "SettingBroadcast",
+    "KillExplorer",
+    "StartExplorer",
+    "Verify",
+    "RestoreWindows",
+    "RestoreFocus",
+    "RestoreDeferred"
+};
+
+// Provider GUID is fixed so WPA profiles and collection scripts can enable it by ID.
+// {8C4E9B1E-3F2A-4C7D-9B61-2A5D7E0F4C13}
+TRACELOGGING_DEFINE_PROVIDER(g_traceProvider, "ToggleTaskbarAutohide",
+    (0x8c4e9b1e, 0x3f2a, 0x4c7d, 0x9b, 0x61, 0x2a, 0x5d, 0x7e, 0x0f, 0x4c, 0x13));
+
+ToggleMetrics g_lastToggleMetrics = {};
+
+class StageTimer {
+public:
+    explicit StageTimer(ToggleStage stage);
+    ~StageTimer() { Stop(); }
+    void Stop();
+
+private:
+    ToggleStage m_stage;
+    LARGE_INTEGER m_start;
+    bool m_running;
 };
 
 HWND g_hwnd = NULL;
 NOTIFYICONDATA g_nid = { 0 };
+
+/*
+ * Tray icon cache: one icon per taskbar state, rendered for the tray's
+ * current DPI at startup and rebuilt whenever that DPI changes. The hidden
+ * tray window may never receive WM_DPICHANGED, so display, setting and
+ * TaskbarCreated notifications re-check it too. A state change is a
+ * NIM_MODIFY with the other cached handle.
+ */
+struct TrayIconCache {
+    HICON autohide;
+    HICON visible;
+    UINT dpi;
+};
+TrayIconCache g_trayIcons = {};
 bool g_trayMode = TRAY_MODE;
 UINT WM_TASKBARCREATED = 0;
-bool g_isRestartingExplorer = false;
-HANDLE g_watchdogThread = NULL;
-
-std::vector<ExplorerWindow> GetOpenExplorerWindows();
-void RestoreExplorerWindows(const std::vector<ExplorerWindow>& windows);
-BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam);
-void KillExplorerProcess();
-void StartExplorerProcess();
-bool ToggleTaskbarSetting();
+bool g_taskbarCreatedReceived = false;
+
+/*
+ * Toggle worker (tray mode): clicks only bump g_pendingToggleClicks; the
+ * worker coalesces them and runs ExecuteToggleAction() off the UI thread.
+ * A set request (foreground rules) is kept apart in g_pendingSetOptions,
+ * and the clicks that follow it in g_pendingClicksAfterSet, so that flips
+ * and sets queued together keep their order. All of them are guarded by
+ * g_pendingToggleLock.
+ */
+HANDLE g_toggleWorker = NULL;
+HANDLE g_toggleRequestEvent = NULL;
+HANDLE g_toggleStopEvent = NULL;
+LONG g_pendingToggleClicks = 0;
+LONG g_pendingClicksAfterSet = 0;
+bool g_pendingSetQueued = false;
+SRWLOCK g_pendingToggleLock = SRWLOCK_INIT;
+ToggleOptions g_pendingToggleOptions = {};
+ToggleOptions g_pendingSetOptions = {};
+
+/*
+ * Folder windows held back by --holdminimized: minimized when captured,
+ * not reopened after the restart, and offered in the tray menu instead.
+ * The worker reopens them when g_reopenHeldRequested is set.
+ */
+SRWLOCK g_heldExplorerLock = SRWLOCK_INIT;
+std::vector<ExplorerWindow> g_heldExplorerWindows;
+volatile LONG g_reopenHeldRequested = 0;
+
+// Capture and restore reach the desktop through Desktop(); NULL is the real one.
+DesktopBackend* g_desktopBackend = NULL;
+
+/*
+ * Command line, split once at startup. HasCommandLineOption() and
+ * g_commandLineOptions both read from here.
+ */
+std::vector<std::wstring> g_commandLineArgs;
+bool g_commandLineParsed = false;
+ToggleOptions g_commandLineOptions = {};
+HANDLE g_instanceMutex = NULL;
+HANDLE g_toggleMutex = NULL;
+
+/*
+ * Lean resident mode (--lean): COM is only initialized on the worker for
+ * the duration of a toggle, and the process idles with a trimmed working
+ * set under EcoQoS. ole32.dll is delay-loaded (see the .vcxproj), so it is
+ * not mapped until the first toggle.
+ */
+bool g_leanMode = false;
+bool g_comInitialized = false;
+
+/*
+ * Command sent from a second launch to the resident instance
+ */
+struct ForwardedCommand {
+    DWORD size;
+    ToggleOptions options;
+};
+
+/*
+ * Restore journal: %LOCALAPPDATA%\ToggleTaskbarAutohide\RestoreJournal.bin,
+ * mapped for the life of the process. A restart writes the folder windows
+ * and the foreground window into it before the shell is stopped and marks
+ * it complete after the restore; a journal still pending at startup means
+ * the toggling process died in between, and is replayed.
+ */
+#define JOURNAL_MAGIC 0x4A415454 // 'TTAJ'
+#define JOURNAL_VERSION 1
+#define JOURNAL_SIZE (256 * 1024)
+#define JOURNAL_STATE_COMPLETE 0
+#define JOURNAL_STATE_PENDING 1
+
+struct JournalHeader {
+    DWORD magic;
+    DWORD version;
+    volatile LONG state;
+    DWORD windowCount;
+    DWORD foregroundHwnd;   // HWNDs are 32-bit significant on every platform
+    DesktopWindowKey foregroundKey;
+    WINDOWPLACEMENT foregroundPlacement;
+};
+
+// Followed by pidlSize bytes of ITEMIDLIST; size is rounded up to a DWORD.
+struct JournalWindowRecord {
+    DWORD size;
+    DWORD pidlSize;
+    WINDOWPLACEMENT placement;
+};
+
+HANDLE g_journalFile = NULL;
+HANDLE g_journalMapping = NULL;
+BYTE* g_journalView = NULL;
+
+// Toggle statistics: the shared block of the resident instance, else local.
+// g_stageHistory is the ring of recent durations behind the percentiles.
+HANDLE g_statsMapping = NULL;
+ToggleStatistics g_localStats = {};
+ToggleStatistics* g_stats = &g_localStats;
+SRWLOCK g_statsLock = SRWLOCK_INIT;
+double g_stageHistory[STAGE_COUNT][TOGGLE_STATS_HISTORY] = {};
+
+/*
+ * StuckRects blob layout (see the structure map next to the accessor).
+ * The DWORD at 0x00 is the size the shell declared for the structure.
+ */
+#define STUCKRECTS_MIN_SIZE 0x28
+#define STUCKRECTS_OFFSET_VISIBILITY 0x08
+#define STUCKRECTS_FLAG_AUTOHIDE 0x01
+
+struct StuckRectsBlob {
+    BYTE data[256];
+    DWORD size;
+
+    bool IsValid() const;
+    bool IsAutohide() const;
+    void SetAutohide(bool enable);
+};
+
+/*
+ * Registry transaction: the original blob of every value ToggleTaskbarSetting()
+ * wrote, so the change can be checked against the restarted shell and
+ * undone in the same cycle.
+ */
+struct StuckRectsUndoEntry {
+    bool perMonitor;
+    std::wstring valueName;
+    StuckRectsBlob original;
+};
+
+struct StuckRectsTransaction {
+    std::vector<StuckRectsUndoEntry> entries;
+    bool enableAutohide;
+    bool includesPrimary;
+    bool rolledBack;
+};
+
+HKEY g_stuckRectsKey = NULL;
+
+/*
+ * Resident taskbar state cache (tray mode only). -1 means "not cached";
+ * otherwise holds the visibility byte last seen by the registry watcher.
+ */
+volatile LONG g_cachedTaskbarSetting = -1;
+HKEY g_stateWatchKey = NULL;
+HANDLE g_stateWatchEvent = NULL;
+PTP_WAIT g_stateWatchWait = NULL;
+// Set by StopTaskbarStateWatcher() so a running callback does not re-arm.
+volatile LONG g_stateWatchStopping = 0;
+
+/*
+ * Shell watch (tray mode, UI thread only): after a restart the tray icon
+ * is re-added as soon as the new shell creates Shell_TrayWnd. A thread-pool
+ * wait on the new shell's process handle ends the watch if it dies first.
+ * The generation tags WM_SHELLEXITED so a late callback cannot end a newer
+ * watch.
+ */
+HANDLE g_shellWatchProcess = NULL;
+PTP_WAIT g_shellWatchWait = NULL;
+HWINEVENTHOOK g_shellWatchHook = NULL;
+ULONG_PTR g_shellWatchGeneration = 0;
+
+/*
+ * Foreground rules (--rules=<file>, tray mode, UI thread only): process
+ * image names that want the taskbar auto-hidden while they are in the
+ * foreground. Kept as FNV-1a hashes of the lower-cased file name in a
+ * fixed open-addressing table (0 marks a free slot, at most half full),
+ * so the foreground hook never allocates and returns at once for the
+ * process it classified last.
+ */
+#define RULE_TABLE_SIZE 64
+#define RULE_MAX_COUNT (RULE_TABLE_SIZE / 2)
+// Focus has to stay put this long before a rule acts ...
+#define RULE_DEBOUNCE_MS 1500
+// ... and rule toggles are at least this far apart.
+#define RULE_MIN_INTERVAL_MS 5000
+#define RULE_TIMER_ID 1
+DWORD g_ruleTable[RULE_TABLE_SIZE] = {};
+DWORD g_ruleCount = 0;
+HWINEVENTHOOK g_ruleHook = NULL;
+DWORD g_ruleForegroundProcessId = 0;
+bool g_ruleForegroundMatched = false;
+bool g_ruleEngaged = false;
+bool g_ruleRestoreAutohide = false;
+ULONGLONG g_ruleLastToggleTick = 0;
+
+/*
+ * Resident Explorer window index (tray mode without --lean): the UI thread
+ * keeps one IShellWindows alive and maintains HWND -> folder from its
+ * events. The published copy is what toggles read, from any thread, under
+ * g_explorerIndexLock.
+ */
+struct IndexedExplorerWindow {
+    CComPtr<IWebBrowserApp> webApp;
+    CComPtr<IConnectionPoint> connectionPoint;
+    DWORD cookie;
+    FolderId folder;
+};
+CComPtr<IShellWindows> g_explorerIndexShellWindows;
+CComPtr<IConnectionPoint> g_explorerIndexConnectionPoint;
+DWORD g_explorerIndexCookie = 0;
+std::map<HWND, IndexedExplorerWindow> g_explorerIndexWindows;
+volatile LONG g_explorerIndexRescanPosted = 0;
+SRWLOCK g_explorerIndexLock = SRWLOCK_INIT;
+ExplorerFolderIndex g_explorerIndexPublished;
+bool g_explorerIndexValid = false;
+
+ExplorerFolderIndex BuildExplorerFolderIndex();
+bool StartExplorerIndex();
+void StopExplorerIndex();
+void RefreshExplorerIndex(HWND navigatedHwnd);
+bool CopyExplorerIndex(ExplorerFolderIndex& index);
+bool GetShellWindowFolder(IWebBrowserApp* webApp, FolderId& folder);
+size_t HoldMinimizedExplorerWindows(std::vector<ExplorerWindow>& windows);
+void ReopenHeldExplorerWindows();
+void KillExplorerProcess(bool closeFolderWindows);
+void CloseFolderWindows();
+DWORD GetShellProcessId();
+bool FolderWindowsSurviveShellRestart();
+void EnableSeparateProcessFolders();
+HANDLE StartExplorerProcess();
+bool StartShellWithWatchdog(StuckRectsTransaction& transaction);
+bool WaitForShellReady(HANDLE shellProcess);
+int RunAllSessionsToggle();
+bool ToggleTaskbarSetting(const wchar_t* monitor, ToggleTarget target, StuckRectsTransaction& transaction);
+bool VerifyTaskbarSetting(const StuckRectsTransaction& transaction);
+void RollbackTaskbarSetting(StuckRectsTransaction& transaction);
+void ReapplyTaskbarSetting(const StuckRectsTransaction& transaction);
+bool SetTaskbarAutohideLive(bool enable);
+bool ToggleTaskbarSettingLive();
 bool HasCommandLineOption(const wchar_t* option);
-ForegroundAppInfo GetForegroundAppInfo();
-void RestoreForegroundApp(const ForegroundAppInfo& appInfo);
+const wchar_t* GetCommandLineValue(const wchar_t* prefix);
+bool StartToggleRules();
+void StopToggleRules();
+void ApplyToggleRules();
+void ApplyWindowZOrder(const HWND* topFirst, size_t count);
+DesktopBackend& Desktop();
+DesktopBackend& GetWin32DesktopBackend();
 LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
-void ExecuteToggleAction();
 void SetupTrayIcon(HWND hwnd);
-void UpdateTrayIconTooltip();
+void UpdateTrayIcon();
 void RemoveTrayIcon();
+bool BuildTrayIconCache(UINT dpi);
+void ReloadTrayIconCache(HWND hwnd);
+void DestroyTrayIconCache();
 BYTE GetCurrentTaskbarSetting();
-DWORD WINAPI WatchdogThreadProc(LPVOID lpParam);
+BYTE ReadTaskbarSetting();
+bool IsTaskbarTargetReached(ToggleTarget target, const wchar_t* monitor);
+int GetTaskbarStateExitCode();
+bool InitStuckRects(bool keepOpen);
+void CloseStuckRects();
+bool ReadStuckRects(StuckRectsBlob& blob);
+bool WriteStuckRects(const StuckRectsBlob& blob);
+bool StartTaskbarStateWatcher();
+void StopTaskbarStateWatcher();
+bool StartToggleWorker();
+void StopToggleWorker();
+void QueueToggleRequest(const ToggleOptions& options);
+void ParseCommandLineOptions();
+bool ForwardToResidentInstance();
+void RunToggleAction(ToggleMethod method, const ToggleOptions& options);
+void NotifyShellStarting(HANDLE shellProcess);
+void BeginShellWatch(HANDLE shellProcess);
+void EndShellWatch();
+void TraceToggleSummary();
+void SetResidentIdle(bool idle);
+void TrimResidentMemory();
+bool OpenRestoreJournal();
+void CloseRestoreJournal();
+void WriteRestoreJournal(const std::vector<ExplorerWindow>& windows,
+    const std::vector<ExplorerWindow>& deferred, const ForegroundAppInfo& foreground);
+void CompleteRestoreJournal();
+bool IsJournalIDListTerminated(const BYTE* pidl, DWORD pidlSize);
+void ReplayRestoreJournal();
+bool OpenToggleStatistics();
+void CloseToggleStatistics();
+void RecordToggleStatistics();
+void PublishResidentMemory();
+void InsertStatisticsMenu(HMENU menu);
+
+/*
+ * Stage Timing:
+ * Converts QueryPerformanceCounter ticks to milliseconds, stores the result
+ * in g_lastToggleMetrics and emits StageStart/StageStop events.
+ */
+StageTimer::StageTimer(ToggleStage stage) : m_stage(stage), m_running(true) {
+    TraceLoggingWrite(g_traceProvider, "StageStart",
+        TraceLoggingOpcode(WINEVENT_OPCODE_START),
+        TraceLoggingString(g_stageNames[stage], "Stage"));
+    QueryPerformanceCounter(&m_start);
+}
+
+void StageTimer::Stop() {
+    if (!m_running) return;
+    m_running = false;
+
+    static LARGE_INTEGER frequency = {};
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    double durationMs = (double)(end.QuadPart - m_start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+
+    g_lastToggleMetrics.stageMs[m_stage] += durationMs;
+    g_lastToggleMetrics.stageRan[m_stage] = true;
+    TraceLoggingWrite(g_traceProvider, "StageStop",
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+        TraceLoggingString(g_stageNames[m_stage], "Stage"),
+        TraceLoggingFloat64(durationMs, "DurationMs"));
+}
+
+void TraceToggleSummary() {
+    TraceLoggingWrite(g_traceProvider, "ToggleSummary",
+        TraceLoggingBool(g_lastToggleMetrics.restartedExplorer, "RestartedExplorer"),
+        TraceLoggingBool(g_lastToggleMetrics.rolledBack, "RolledBack"),
+        TraceLoggingFloat64(g_lastToggleMetrics.stageMs[STAGE_TOGGLE], "DurationMs"),
+        TraceLoggingUInt32(g_lastToggleMetrics.windowsCaptured, "WindowsCaptured"),
+        TraceLoggingUInt32(g_lastToggleMetrics.windowsRestored, "WindowsRestored"),
+        TraceLoggingUInt32(g_lastToggleMetrics.windowsDeferred, "WindowsDeferred"),
+        TraceLoggingUInt32(g_lastToggleMetrics.restoreFailures, "RestoreFailures"));
+}
+
+/*
+ * Message-pumping wait:
+ * Blocks until done() reports true or the timeout elapses. Messages keep
+ * being dispatched meanwhile, so broadcasts and out-of-context WinEvent
+ * callbacks wake the loop and done() is re-evaluated on every wake-up
+ * instead of on a fixed polling interval.
+ */
+template <typename Predicate>
+bool WaitForCondition(Predicate done, DWORD timeoutMs) {
+    ULONGLONG deadline = GetTickCount64() + timeoutMs;
+    while (!done()) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) return false;
+
+        DWORD result = MsgWaitForMultipleObjectsEx(0, NULL, (DWORD)(deadline - now),
+            QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        if (result == WAIT_FAILED) return false;
+
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            if (msg.message == WM_QUIT) {
+                PostQuitMessage((int)msg.wParam);
+                return done();
+            }
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+    return true;
+}
+
+// Out-of-context WinEvent callbacks are only used to wake WaitForCondition().
+void CALLBACK WakeOnWinEvent(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG idObject,
+    LONG idChild, DWORD eventThread, DWORD eventTime) {
+}
+
+/*
+ * Shell Readiness Listener:
+ * Message-only windows do not receive broadcasts, so a hidden top-level
+ * window is used to catch the TaskbarCreated message of the new shell.
+ */
+LRESULT CALLBACK ShellListenerWndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    if (message == WM_TASKBARCREATED && WM_TASKBARCREATED != 0) {
+        g_taskbarCreatedReceived = true;
+        return 0;
+    }
+    return DefWindowProc(hwnd, message, wParam, lParam);
+}
+
+HWND CreateShellListenerWindow() {
+    static bool registered = false;
+    HINSTANCE hInstance = GetModuleHandleW(NULL);
+    if (!registered) {
+        WNDCLASSEXW wcex = { sizeof(WNDCLASSEXW) };
+        wcex.lpfnWndProc = ShellListenerWndProc;
+        wcex.hInstance = hInstance;
+        wcex.lpszClassName = L"ToggleTaskbarAutohideShellListener";
+        registered = RegisterClassExW(&wcex) != 0;
+    }
+    return CreateWindowExW(WS_EX_TOOLWINDOW, L"ToggleTaskbarAutohideShellListener", L"",
+        WS_POPUP, 0, 0, 0, 0, NULL, NULL, hInstance, NULL);
+}
 
 /*
- * Watchdog Thread:
- * This thread monitors system state after explorer.exe restarts
- * and ensures tray icon is properly recreated
+ * Pre-restart capture: the state gathered by the thread-pool tasks that
+ * run ahead of the kill.
  */
-DWORD WINAPI WatchdogThreadProc(LPVOID lpParam) {
-    Sleep(2000);
+struct PreRestartCapture {
+    const wchar_t* monitor;
+    ToggleTarget target;
+    std::vector<ExplorerWindow> explorerWindows;
+    StuckRectsTransaction transaction;
+};
+
+// Folder windows are enumerated through COM proxies, from an MTA.
+VOID CALLBACK CaptureFolderWindowsWork(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    PreRestartCapture* capture = (PreRestartCapture*)context;
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (SUCCEEDED(hr)) {
+        StageTimer stage(STAGE_SNAPSHOT_EXPLORER);
+        capture->explorerWindows = GetOpenExplorerWindows();
+        stage.Stop();
+        CoUninitialize();
+    }
+}
+
+VOID CALLBACK WriteTaskbarSettingWork(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    PreRestartCapture* capture = (PreRestartCapture*)context;
+    ToggleTaskbarSetting(capture->monitor, capture->target, capture->transaction);
+}
+
+// Runs callback on the thread pool, or inline if no work object is available.
+PTP_WORK SubmitCaptureWork(PTP_WORK_CALLBACK callback, PVOID context) {
+    PTP_WORK work = CreateThreadpoolWork(callback, context, NULL);
+    if (!work) {
+        callback(NULL, context, NULL);
+        return NULL;
+    }
+    SubmitThreadpoolWork(work);
+    return work;
+}
+
+void JoinCaptureWork(PTP_WORK work) {
+    if (!work) return;
+    WaitForThreadpoolWorkCallbacks(work, FALSE);
+    CloseThreadpoolWork(work);
+}
+
+/*
+ * Restore Journal:
+ * The file is mapped once, so recording a toggle is a copy into the view
+ * and needs no I/O on the critical path: the pages reach the file from the
+ * system cache even if this process is killed. (A power loss in that
+ * window is not covered; flushing would cost milliseconds.) Payload first,
+ * state last, so a torn write is never taken for a pending journal.
+ */
+bool OpenRestoreJournal() {
+    wchar_t path[MAX_PATH];
+    DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", path, ARRAYSIZE(path));
+    if (length == 0 || length >= ARRAYSIZE(path) ||
+        FAILED(StringCchCatW(path, ARRAYSIZE(path), L"\\ToggleTaskbarAutohide"))) {
+        return false;
+    }
+    CreateDirectoryW(path, NULL);
+    if (FAILED(StringCchCatW(path, ARRAYSIZE(path), L"\\RestoreJournal.bin"))) return false;
+
+    g_journalFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_journalFile == INVALID_HANDLE_VALUE) {
+        g_journalFile = NULL;
+        return false;
+    }
+    g_journalMapping = CreateFileMappingW(g_journalFile, NULL, PAGE_READWRITE, 0, JOURNAL_SIZE, NULL);
+    if (g_journalMapping) g_journalView = (BYTE*)MapViewOfFile(g_journalMapping, FILE_MAP_WRITE, 0, 0, JOURNAL_SIZE);
+    if (!g_journalView) {
+        CloseRestoreJournal();
+        return false;
+    }
+    return true;
+}
+
+void CloseRestoreJournal() {
+    if (g_journalView) {
+        UnmapViewOfFile(g_journalView);
+        g_journalView = NULL;
+    }
+    if (g_journalMapping) {
+        CloseHandle(g_journalMapping);
+        g_journalMapping = NULL;
+    }
+    if (g_journalFile) {
+        CloseHandle(g_journalFile);
+        g_journalFile = NULL;
+    }
+}
+
+void WriteRestoreJournal(const std::vector<ExplorerWindow>& windows,
+    const std::vector<ExplorerWindow>& deferred, const ForegroundAppInfo& foreground) {
+    if (!g_journalView) return;
+    JournalHeader* header = (JournalHeader*)g_journalView;
+    header->state = JOURNAL_STATE_COMPLETE;
+    MemoryBarrier();
+
+    BYTE* cursor = g_journalView + sizeof(JournalHeader);
+    BYTE* end = g_journalView + JOURNAL_SIZE;
+    DWORD count = 0;
+    const std::vector<ExplorerWindow>* lists[] = { &windows, &deferred };
+    for (const std::vector<ExplorerWindow>* list : lists) {
+        for (const ExplorerWindow& window : *list) {
+            if (window.folder.Empty()) continue;
+            DWORD pidlSize = ILGetSize(window.folder.Get());
+            DWORD size = (sizeof(JournalWindowRecord) + pidlSize + 3) & ~3u;
+            if ((size_t)(end - cursor) < size) break;
+            JournalWindowRecord* record = (JournalWindowRecord*)cursor;
+            record->size = size;
+            record->pidlSize = pidlSize;
+            record->placement = window.placement;
+            memcpy(record + 1, window.folder.Get(), pidlSize);
+            cursor += size;
+            count++;
+        }
+    }
+
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    header->windowCount = count;
+    header->foregroundHwnd = HandleToUlong(foreground.hwnd);
+    header->foregroundKey = foreground.key;
+    header->foregroundPlacement = foreground.placement;
+    MemoryBarrier();
+    header->state = JOURNAL_STATE_PENDING;
+}
+
+void CompleteRestoreJournal() {
+    if (g_journalView) ((JournalHeader*)g_journalView)->state = JOURNAL_STATE_COMPLETE;
+}
+
+/*
+ * Toggle Statistics:
+ * Written by the toggling thread after every toggle, under g_statsLock and
+ * bracketed by sequence increments for readers in other processes. The
+ * block is created by the resident instance only; a reused block (kept
+ * open by a reader across a tray restart) starts over from zero.
+ */
+bool OpenToggleStatistics() {
+    g_statsMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        0, sizeof(ToggleStatistics), TOGGLE_STATS_MAPPING_NAME);
+    if (!g_statsMapping) return false;
+    ToggleStatistics* view = (ToggleStatistics*)MapViewOfFile(g_statsMapping, FILE_MAP_WRITE,
+        0, 0, sizeof(ToggleStatistics));
+    if (!view) {
+        CloseHandle(g_statsMapping);
+        g_statsMapping = NULL;
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_statsLock);
+    InterlockedIncrement(&view->sequence);
+    LONG sequence = view->sequence;
+    *view = g_localStats;
+    view->sequence = sequence;
+    view->magic = TOGGLE_STATS_MAGIC;
+    view->version = TOGGLE_STATS_VERSION;
+    view->size = sizeof(ToggleStatistics);
+    view->processId = GetCurrentProcessId();
+    InterlockedIncrement(&view->sequence);
+    g_stats = view;
+    ReleaseSRWLockExclusive(&g_statsLock);
+    return true;
+}
+
+void CloseToggleStatistics() {
+    if (!g_statsMapping) return;
+    AcquireSRWLockExclusive(&g_statsLock);
+    ToggleStatistics* view = g_stats;
+    g_localStats = *view;
+    g_stats = &g_localStats;
+    ReleaseSRWLockExclusive(&g_statsLock);
+    UnmapViewOfFile(view);
+    CloseHandle(g_statsMapping);
+    g_statsMapping = NULL;
+}
+
+void UpdateMemoryStatistics(ToggleStatistics& statistics) {
+    PROCESS_MEMORY_COUNTERS_EX counters = { sizeof(counters) };
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) return;
+    statistics.workingSetBytes = counters.WorkingSetSize;
+    statistics.privateBytes = counters.PrivateUsage;
+}
+
+// Nearest-rank percentile (p in 0..100) of count sorted samples
+double NearestRankPercentile(const double* sorted, DWORD count, double p) {
+    if (count == 0) return 0.0;
+    DWORD rank = (DWORD)ceil(p / 100.0 * count);
+    if (rank == 0) rank = 1;
+    return sorted[min(rank, count) - 1];
+}
+
+void RecordToggleStatistics() {
+    const ToggleMetrics& metrics = g_lastToggleMetrics;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+
+    AcquireSRWLockExclusive(&g_statsLock);
+    ToggleStatistics& statistics = *g_stats;
+    InterlockedIncrement(&statistics.sequence);
+    statistics.lastToggleTime = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    statistics.toggles++;
+    if (!metrics.succeeded) statistics.failedToggles++;
+    if (metrics.restartedExplorer) {
+        statistics.explorerRestarts++;
+        if (!metrics.succeeded) statistics.explorerRestartFailures++;
+    }
+    if (metrics.rolledBack) statistics.rollbacks++;
+    statistics.windowsCaptured += metrics.windowsCaptured;
+    statistics.windowsRestored += metrics.windowsRestored;
+    statistics.windowsLost += metrics.restoreFailures;
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        if (!metrics.stageRan[stage]) continue;
+        ToggleStageStatistics& stageStatistics = statistics.stages[stage];
+        g_stageHistory[stage][stageStatistics.samples % TOGGLE_STATS_HISTORY] = metrics.stageMs[stage];
+        stageStatistics.samples++;
+        stageStatistics.lastMs = metrics.stageMs[stage];
+
+        double sorted[TOGGLE_STATS_HISTORY];
+        DWORD count = min(stageStatistics.samples, (DWORD)TOGGLE_STATS_HISTORY);
+        memcpy(sorted, g_stageHistory[stage], count * sizeof(double));
+        std::sort(sorted, sorted + count);
+        stageStatistics.p50Ms = NearestRankPercentile(sorted, count, 50);
+        stageStatistics.p95Ms = NearestRankPercentile(sorted, count, 95);
+        stageStatistics.p99Ms = NearestRankPercentile(sorted, count, 99);
+    }
+    UpdateMemoryStatistics(statistics);
+    InterlockedIncrement(&statistics.sequence);
+    ReleaseSRWLockExclusive(&g_statsLock);
+}
+
+void PublishResidentMemory() {
+    AcquireSRWLockExclusive(&g_statsLock);
+    InterlockedIncrement(&g_stats->sequence);
+    UpdateMemoryStatistics(*g_stats);
+    InterlockedIncrement(&g_stats->sequence);
+    ReleaseSRWLockExclusive(&g_statsLock);
+}
+
+void GetToggleStatistics(ToggleStatistics& statistics) {
+    AcquireSRWLockShared(&g_statsLock);
+    statistics = *g_stats;
+    ReleaseSRWLockShared(&g_statsLock);
+}
+
+/*
+ * "Statistics" submenu of the tray menu: the same counters as the shared
+ * block, with the memory figures refreshed as the menu opens.
+ */
+void InsertStatisticsMenu(HMENU menu) {
+    HMENU statisticsMenu = CreatePopupMenu();
+    if (!statisticsMenu) return;
+    PublishResidentMemory();
+    ToggleStatistics statistics;
+    GetToggleStatistics(statistics);
+
+    wchar_t text[128];
+    UINT lineFlags = MF_BYPOSITION | MF_STRING | MF_GRAYED;
+    StringCchPrintfW(text, ARRAYSIZE(text), L"Toggles: %I64u (%I64u failed)",
+        statistics.toggles, statistics.failedToggles);
+    InsertMenu(statisticsMenu, -1, lineFlags, ID_TRAY_STATISTICS, text);
+    StringCchPrintfW(text, ARRAYSIZE(text), L"Explorer restarts: %I64u (%I64u failed, %I64u rolled back)",
+        statistics.explorerRestarts, statistics.explorerRestartFailures, statistics.rollbacks);
+    InsertMenu(statisticsMenu, -1, lineFlags, ID_TRAY_STATISTICS, text);
+    StringCchPrintfW(text, ARRAYSIZE(text), L"Folder windows restored: %I64u, lost: %I64u",
+        statistics.windowsRestored, statistics.windowsLost);
+    InsertMenu(statisticsMenu, -1, lineFlags, ID_TRAY_STATISTICS, text);
+    StringCchPrintfW(text, ARRAYSIZE(text), L"Working set: %I64u KB, private bytes: %I64u KB",
+        statistics.workingSetBytes / 1024, statistics.privateBytes / 1024);
+    InsertMenu(statisticsMenu, -1, lineFlags, ID_TRAY_STATISTICS, text);
+
+    bool separated = false;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const ToggleStageStatistics& stageStatistics = statistics.stages[stage];
+        if (stageStatistics.samples == 0) continue;
+        if (!separated) {
+            InsertMenu(statisticsMenu, -1, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
+            separated = true;
+        }
+        StringCchPrintfW(text, ARRAYSIZE(text), L"%S: last %.1f ms, p50 %.1f, p95 %.1f, p99 %.1f (n=%u)",
+            g_stageNames[stage], stageStatistics.lastMs, stageStatistics.p50Ms,
+            stageStatistics.p95Ms, stageStatistics.p99Ms, stageStatistics.samples);
+        InsertMenu(statisticsMenu, -1, lineFlags, ID_TRAY_STATISTICS, text);
+    }
+    InsertMenu(menu, -1, MF_BYPOSITION | MF_POPUP | MF_STRING, (UINT_PTR)statisticsMenu, L"&Statistics");
+}
+
+/*
+ * A journal record's ITEMIDLIST must end in its zero-length terminator
+ * within pidlSize; a torn or corrupt record would otherwise run the shell's
+ * PIDL walkers past the end of the view.
+ */
+bool IsJournalIDListTerminated(const BYTE* pidl, DWORD pidlSize) {
+    DWORD offset = 0;
+    while (pidlSize - offset >= sizeof(USHORT)) {
+        USHORT cb;
+        memcpy(&cb, pidl + offset, sizeof(cb));
+        if (cb == 0) return true;
+        if (cb < sizeof(USHORT) || cb > pidlSize - offset) return false;
+        offset += cb;
+    }
+    return false;
+}
+
+/*
+ * Startup replay of a pending journal, under the toggle mutex so a toggle
+ * still running in another process is not mistaken for a dead one. The
+ * shell is started if the dead toggle left none, and folder windows that
+ * were already reopened before it died are not opened a second time.
+ */
+void ReplayRestoreJournal() {
+    if (!g_journalView) return;
+    JournalHeader* header = (JournalHeader*)g_journalView;
+    DWORD waitResult = g_toggleMutex ? WaitForSingleObject(g_toggleMutex, INFINITE) : WAIT_FAILED;
+    if (header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION &&
+        header->state == JOURNAL_STATE_PENDING) {
+        std::vector<ExplorerWindow> windows;
+        const BYTE* cursor = g_journalView + sizeof(JournalHeader);
+        const BYTE* end = g_journalView + JOURNAL_SIZE;
+        for (DWORD i = 0; i < header->windowCount; i++) {
+            const JournalWindowRecord* record = (const JournalWindowRecord*)cursor;
+            if ((size_t)(end - cursor) < sizeof(JournalWindowRecord) || record->size < sizeof(JournalWindowRecord) ||
+                record->size > (size_t)(end - cursor) || record->pidlSize > record->size - sizeof(JournalWindowRecord) ||
+                !IsJournalIDListTerminated((const BYTE*)(record + 1), record->pidlSize)) {
+                break;
+            }
+            ExplorerWindow window = {};
+            window.folder.Attach(ILCloneFull((PCIDLIST_ABSOLUTE)(record + 1)));
+            window.placement = record->placement;
+            window.position = record->placement.rcNormalPosition;
+            window.zOrder = i;
+            windows.push_back(std::move(window));
+            cursor += record->size;
+        }
+        TraceLoggingWrite(g_traceProvider, "JournalReplay",
+            TraceLoggingUInt32((UINT32)windows.size(), "Windows"));
+
+        HRESULT hr = CoInitialize(NULL);
+        if (!FindWindowW(L"Shell_TrayWnd", NULL)) {
+            HANDLE shellProcess = StartExplorerProcess();
+            if (shellProcess) {
+                WaitForShellReady(shellProcess);
+                CloseHandle(shellProcess);
+            }
+        }
+        ExplorerFolderIndex open = BuildExplorerFolderIndex();
+        for (const auto& entry : open) {
+            for (size_t w = 0; w < windows.size(); w++) {
+                if (!windows[w].folder.Equals(entry.second)) continue;
+                windows.erase(windows.begin() + w);
+                break;
+            }
+        }
+        WindowRemap remap;
+        RestoreExplorerWindows(windows, remap);
+
+        DesktopSnapshot snapshot = {};
+        snapshot.foreground.hwnd = (HWND)ULongToHandle(header->foregroundHwnd);
+        snapshot.foreground.key = header->foregroundKey;
+        snapshot.foreground.placement = header->foregroundPlacement;
+        RestoreDesktopSnapshot(snapshot, remap);
+        if (SUCCEEDED(hr)) CoUninitialize();
+        header->state = JOURNAL_STATE_COMPLETE;
+    }
+    if (waitResult == WAIT_OBJECT_0 || waitResult == WAIT_ABANDONED) {
+        ReleaseMutex(g_toggleMutex);
+    }
+}
+
+/*
+ * Main Action Orchestrator:
+ * This function coordinates the entire toggle operation:
+ * 1. Tries to flip auto-hide on the running shell (no restart needed)
+ * 2. Otherwise captures the desktop and Explorer windows and toggles the
+ *    registry settings, as concurrent tasks
+ * 3. Restarts Explorer process and verifies it against the registry change
+ * 4. Restores the visible Explorer windows, the desktop Z-order and focus,
+ *    then the minimized and other-monitor windows at idle priority
+ * TOGGLE_METHOD_LIVE / TOGGLE_METHOD_RESTART pin one of the two paths,
+ * which is how the benchmark compares them.
+ * Toggles are serialized across processes by the toggle mutex, so a CLI
+ * launch can never restart Explorer underneath the tray instance.
+ */
+void ExecuteToggleAction(ToggleMethod method, const ToggleOptions* options) {
+    ParseCommandLineOptions();
+    if (!options) options = &g_commandLineOptions;
+
+    DWORD waitResult = g_toggleMutex ? WaitForSingleObject(g_toggleMutex, INFINITE) : WAIT_FAILED;
+    {
+        ArenaScope arena;
+        RunToggleAction(method, *options);
+    }
+    RecordToggleStatistics();
+    if (waitResult == WAIT_OBJECT_0 || waitResult == WAIT_ABANDONED) {
+        ReleaseMutex(g_toggleMutex);
+    }
+}
+
+void RunToggleAction(ToggleMethod method, const ToggleOptions& options) {
+    ZeroMemory(&g_lastToggleMetrics, sizeof(g_lastToggleMetrics));
+    StageTimer totalTimer(STAGE_TOGGLE);
+
+    // Re-checked under the toggle mutex: another process may have set the
+    // state since this request was made.
+    if (IsTaskbarTargetReached(options.target, options.monitor)) {
+        g_lastToggleMetrics.succeeded = true;
+        totalTimer.Stop();
+        TraceToggleSummary();
+        return;
+    }
+
+    // ABM_SETSTATE is global, so a single-monitor toggle has to go through
+    // the per-monitor blobs and a restart.
+    if (method == TOGGLE_METHOD_AUTO && (options.restartExplorer || options.monitor[0])) {
+        method = TOGGLE_METHOD_RESTART;
+    }
+    bool toggledLive = false;
+    if (method != TOGGLE_METHOD_RESTART) {
+        StageTimer stage(STAGE_LIVE_TOGGLE);
+        toggledLive = options.target == TOGGLE_TARGET_FLIP
+            ? ToggleTaskbarSettingLive()
+            : SetTaskbarAutohideLive(options.target == TOGGLE_TARGET_AUTOHIDE);
+    }
+    if (toggledLive || method == TOGGLE_METHOD_LIVE) {
+        g_lastToggleMetrics.succeeded = toggledLive;
+        if (g_stateWatchWait) InterlockedExchange(&g_cachedTaskbarSetting, ReadTaskbarSetting());
+        totalTimer.Stop();
+        TraceToggleSummary();
+        return;
+    }
+
+    g_lastToggleMetrics.restartedExplorer = true;
+    if (options.separateProcess) EnableSeparateProcessFolders();
+    // Folder windows hosted outside the shell process outlive the restart,
+    // so there is nothing to close, capture or reopen.
+    bool foldersSurvive = FolderWindowsSurviveShellRestart();
+    bool shouldReopenExplorer = !options.noReopenExplorer && !foldersSurvive;
+
+    // The folder capture and the registry write (whose broadcast can stall
+    // behind hung windows) run on the thread pool while this thread takes
+    // the desktop snapshot; all three are joined before the kill.
+    PreRestartCapture capture = {};
+    capture.monitor = options.monitor;
+    capture.target = options.target;
+    PTP_WORK folderWork = shouldReopenExplorer ? SubmitCaptureWork(CaptureFolderWindowsWork, &capture) : NULL;
+    PTP_WORK settingWork = SubmitCaptureWork(WriteTaskbarSettingWork, &capture);
+    DesktopSnapshot desktop;
+    {
+        StageTimer stage(STAGE_SNAPSHOT_FOREGROUND);
+        desktop = CaptureDesktopSnapshot();
+    }
+    JoinCaptureWork(folderWork);
+    JoinCaptureWork(settingWork);
+    std::vector<ExplorerWindow>& explorerWindows = capture.explorerWindows;
+    StuckRectsTransaction& transaction = capture.transaction;
+    g_lastToggleMetrics.windowsCaptured = (DWORD)explorerWindows.size();
+    std::vector<ExplorerWindow> deferredWindows;
+    SplitDeferredExplorerWindows(explorerWindows, desktop.foreground.hwnd, deferredWindows);
+    WriteRestoreJournal(explorerWindows, deferredWindows, desktop.foreground);
+    {
+        StageTimer stage(STAGE_KILL_EXPLORER);
+        KillExplorerProcess(!foldersSurvive);
+    }
+    // A graceful exit saves the shell's in-memory taskbar state over the
+    // blobs written above. Left untimed so that STAGE_REGISTRY_WRITE is
+    // recorded once per toggle.
+    ReapplyTaskbarSetting(transaction);
+    bool shellReady;
+    {
+        StageTimer stage(STAGE_START_EXPLORER);
+        shellReady = StartShellWithWatchdog(transaction);
+    }
+    if (shellReady && !transaction.rolledBack) {
+        // A shell that ignored the new blob is corrected live if it can be;
+        // otherwise the registry goes back to what the shell is showing.
+        StageTimer stage(STAGE_VERIFY);
+        g_lastToggleMetrics.settingVerified = VerifyTaskbarSetting(transaction);
+        if (!g_lastToggleMetrics.settingVerified && !SetTaskbarAutohideLive(transaction.enableAutohide)) {
+            RollbackTaskbarSetting(transaction);
+        }
+    }
+    g_lastToggleMetrics.rolledBack = transaction.rolledBack;
+    // The watcher fired while the old shell still reported the old state,
+    // and a reapply that found the blobs correct left nothing to notice.
+    if (g_stateWatchWait) InterlockedExchange(&g_cachedTaskbarSetting, ReadTaskbarSetting());
+    WindowRemap remap;
+    size_t restoredCount = 0;
+    if (shouldReopenExplorer) {
+        StageTimer stage(STAGE_RESTORE_WINDOWS);
+        restoredCount = RestoreExplorerWindows(explorerWindows, remap);
+    }
+    {
+        StageTimer stage(STAGE_RESTORE_FOCUS);
+        RestoreDesktopSnapshot(desktop, remap);
+    }
+    // Focus is back; what remains cannot be seen from where the user is.
+    size_t heldCount = 0;
+    if (!deferredWindows.empty()) {
+        StageTimer stage(STAGE_RESTORE_DEFERRED);
+        g_lastToggleMetrics.windowsDeferred = (DWORD)deferredWindows.size();
+        if (options.holdMinimized && g_toggleWorker) heldCount = HoldMinimizedExplorerWindows(deferredWindows);
+        restoredCount += RestoreDeferredExplorerWindows(deferredWindows, desktop, remap);
+    }
+    CompleteRestoreJournal();
+    g_lastToggleMetrics.windowsRestored = (DWORD)restoredCount;
+    g_lastToggleMetrics.restoreFailures = g_lastToggleMetrics.windowsCaptured - (DWORD)(restoredCount + heldCount);
+    g_lastToggleMetrics.succeeded = shellReady && !transaction.rolledBack;
+    totalTimer.Stop();
+    TraceToggleSummary();
+}
+
+/*
+ * Toggle Worker:
+ * Runs toggles on a dedicated STA thread so the tray message pump never
+ * blocks on an Explorer restart. A request on an idle worker starts at
+ * once. Clicks that arrive while a toggle is running are merged when it
+ * finishes: an even number of pending clicks is a no-op, an odd number
+ * becomes a single toggle. A pending set request runs between the flips
+ * queued before it and those queued after it. Progress is posted back to
+ * the tray window as WM_TOGGLEPROGRESS.
+ */
+DWORD WINAPI ToggleWorkerThreadProc(LPVOID lpParam) {
+    if (!g_leanMode) {
+        HRESULT hr = CoInitialize(NULL);
+        if (FAILED(hr)) return 1;
+    }
+
+    HANDLE waitHandles[] = { g_toggleStopEvent, g_toggleRequestEvent };
+    for (;;) {
+        DWORD result = WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE);
+        if (result != WAIT_OBJECT_0 + 1) break;
+
+        // Everything queued since the last toggle started is taken at once;
+        // the request event is auto-reset, so later clicks wake the next pass.
+        AcquireSRWLockExclusive(&g_pendingToggleLock);
+        ToggleOptions steps[3];
+        int stepCount = 0;
+        if (g_pendingToggleClicks % 2 != 0) steps[stepCount++] = g_pendingToggleOptions;
+        if (g_pendingSetQueued) steps[stepCount++] = g_pendingSetOptions;
+        if (g_pendingClicksAfterSet % 2 != 0) steps[stepCount++] = g_pendingToggleOptions;
+        g_pendingToggleClicks = 0;
+        g_pendingClicksAfterSet = 0;
+        g_pendingSetQueued = false;
+        ReleaseSRWLockExclusive(&g_pendingToggleLock);
+        if (InterlockedExchange(&g_reopenHeldRequested, 0)) ReopenHeldExplorerWindows();
+        if (stepCount == 0) continue;
+
+        PostMessage(g_hwnd, WM_TOGGLEPROGRESS, TOGGLE_PROGRESS_STARTED, 0);
+        if (g_leanMode) {
+            SetResidentIdle(false);
+            HRESULT hr = CoInitialize(NULL);
+            if (SUCCEEDED(hr)) {
+                for (int i = 0; i < stepCount; i++) ExecuteToggleAction(TOGGLE_METHOD_AUTO, &steps[i]);
+                CoUninitialize();
+            }
+        }
+        else {
+            for (int i = 0; i < stepCount; i++) ExecuteToggleAction(TOGGLE_METHOD_AUTO, &steps[i]);
+        }
+        PostMessage(g_hwnd, WM_TOGGLEPROGRESS, TOGGLE_PROGRESS_FINISHED, 0);
+        if (g_leanMode) {
+            SetResidentIdle(true);
+            TrimResidentMemory();
+        }
+    }
+
+    if (!g_leanMode) CoUninitialize();
+    return 0;
+}
+
+bool StartToggleWorker() {
+    g_toggleRequestEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    g_toggleStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (g_toggleRequestEvent && g_toggleStopEvent) {
+        g_toggleWorker = CreateThread(NULL, 0, ToggleWorkerThreadProc, NULL, 0, NULL);
+    }
+    if (!g_toggleWorker) {
+        StopToggleWorker();
+        return false;
+    }
+    return true;
+}
+
+void StopToggleWorker() {
+    if (g_toggleWorker) {
+        // Let a toggle that is already running finish; abandoning it would
+        // leave the user without a shell.
+        SetEvent(g_toggleStopEvent);
+        WaitForSingleObject(g_toggleWorker, INFINITE);
+        CloseHandle(g_toggleWorker);
+        g_toggleWorker = NULL;
+    }
+    if (g_toggleRequestEvent) {
+        CloseHandle(g_toggleRequestEvent);
+        g_toggleRequestEvent = NULL;
+    }
+    if (g_toggleStopEvent) {
+        CloseHandle(g_toggleStopEvent);
+        g_toggleStopEvent = NULL;
+    }
+}
+
+/*
+ * The options of the most recent click apply to the coalesced flips. A set
+ * request replaces the one already pending; the clicks queued after that
+ * one then count as coming before the new set.
+ */
+void QueueToggleRequest(const ToggleOptions& options) {
+    AcquireSRWLockExclusive(&g_pendingToggleLock);
+    if (options.target == TOGGLE_TARGET_FLIP) {
+        g_pendingToggleOptions = options;
+        if (g_pendingSetQueued) g_pendingClicksAfterSet++;
+        else g_pendingToggleClicks++;
+    }
+    else {
+        g_pendingToggleClicks += g_pendingClicksAfterSet;
+        g_pendingClicksAfterSet = 0;
+        g_pendingSetOptions = options;
+        g_pendingSetQueued = true;
+    }
+    ReleaseSRWLockExclusive(&g_pendingToggleLock);
+    SetEvent(g_toggleRequestEvent);
+}
+
+/*
+ * Runtime setup shared by the application and the benchmark:
+ * COM, the trace provider, the TaskbarCreated message and StuckRects.
+ */
+bool InitToggleRuntime(bool resident) {
+    // A lean resident UI thread never touches COM; only the worker does.
+    if (!(resident && g_leanMode)) {
+        HRESULT hr = CoInitialize(NULL);
+        if (FAILED(hr)) return false;
+        g_comInitialized = true;
+    }
+    TraceLoggingRegister(g_traceProvider);
+    WM_TASKBARCREATED = RegisterWindowMessageW(L"TaskbarCreated");
+    ParseCommandLineOptions();
+    g_toggleMutex = CreateMutexW(NULL, FALSE, TOGGLE_MUTEX_NAME);
+    InitStuckRects(resident);
+    OpenRestoreJournal();
+    if (resident) OpenToggleStatistics();
+    return true;
+}
+
+void ShutdownToggleRuntime() {
+    CloseToggleStatistics();
+    CloseRestoreJournal();
+    CloseStuckRects();
+    if (g_toggleMutex) {
+        CloseHandle(g_toggleMutex);
+        g_toggleMutex = NULL;
+    }
+    TraceLoggingUnregister(g_traceProvider);
+    if (g_comInitialized) {
+        CoUninitialize();
+        g_comInitialized = false;
+    }
+}
+
+/*
+ * Lean Mode Helpers:
+ * While idle the process is marked for EcoQoS and idle priority; a toggle
+ * switches back to normal scheduling so the restart is not slowed down.
+ * SetProcessInformation is resolved at runtime: it is missing before
+ * Windows 8, and older builds only get the priority class.
+ */
+typedef BOOL(WINAPI* SetProcessInformationProc)(HANDLE process,
+    PROCESS_INFORMATION_CLASS informationClass, LPVOID information, DWORD size);
+
+void SetResidentIdle(bool idle) {
+    static SetProcessInformationProc setProcessInformation = (SetProcessInformationProc)GetProcAddress(
+        GetModuleHandleW(L"kernel32.dll"), "SetProcessInformation");
+    if (setProcessInformation) {
+        PROCESS_POWER_THROTTLING_STATE throttling = {};
+        throttling.Version = PROCESS_POWER_THROTTLING_CURRENT_VERSION;
+        throttling.ControlMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+        throttling.StateMask = idle ? PROCESS_POWER_THROTTLING_EXECUTION_SPEED : 0;
+        setProcessInformation(GetCurrentProcess(), ProcessPowerThrottling, &throttling, sizeof(throttling));
+    }
+    SetPriorityClass(GetCurrentProcess(), idle ? IDLE_PRIORITY_CLASS : NORMAL_PRIORITY_CLASS);
+}
+
+void TrimResidentMemory() {
+    HeapCompact(GetProcessHeap(), 0);
+    SetProcessWorkingSetSize(GetCurrentProcess(), (SIZE_T)-1, (SIZE_T)-1);
+
+    PROCESS_MEMORY_COUNTERS_EX counters = { sizeof(counters) };
+    if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+        TraceLoggingWrite(g_traceProvider, "ResidentMemory",
+            TraceLoggingUInt64(counters.PrivateUsage, "PrivateBytes"),
+            TraceLoggingUInt64(counters.WorkingSetSize, "WorkingSetBytes"));
+    }
+    PublishResidentMemory();
+}
+
+#ifndef TOGGLE_BENCHMARK
+/*
+ * Application Entry Point:
+ */
+int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
+    _In_ LPWSTR lpCmdLine, _In_ int nCmdShow) {
+    UNREFERENCED_PARAMETER(hPrevInstance);
+    UNREFERENCED_PARAMETER(nCmdShow);
+
+    ParseCommandLineOptions();
+    // --status, and --enable / --disable when the taskbar is already in
+    // that state, are answered from the AppBar state alone: no instance
+    // mutex, COM or registry setup, and no Explorer restart.
+    if (HasCommandLineOption(L"--status")) return GetTaskbarStateExitCode();
+    if (HasCommandLineOption(L"--allsessions")) return RunAllSessionsToggle();
+    bool setState = g_commandLineOptions.target != TOGGLE_TARGET_FLIP;
+    if (setState && IsTaskbarTargetReached(g_commandLineOptions.target, g_commandLineOptions.monitor)) {
+        return GetTaskbarStateExitCode();
+    }
+
+    // Setting a state is a one-shot run in this process, so that the exit
+    // code can report the result.
+    g_trayMode = !setState && (HasCommandLineOption(L"--tray") || TRAY_MODE);
+    g_leanMode = g_trayMode && HasCommandLineOption(L"--lean");
+
+    // Another instance is resident: hand it the command before paying for
+    // COM and registry setup here. A bare --tray launch has nothing to hand
+    // over.
+    g_instanceMutex = CreateMutexW(NULL, FALSE, INSTANCE_MUTEX_NAME);
+    if (g_instanceMutex && GetLastError() == ERROR_ALREADY_EXISTS) {
+        bool forwarded = !setState && (HasCommandLineOption(L"--tray") || ForwardToResidentInstance());
+        CloseHandle(g_instanceMutex);
+        if (forwarded) return 0;
+        g_instanceMutex = NULL;
+        g_trayMode = false;
+        g_leanMode = false;
+    }
+    else if (!g_trayMode && g_instanceMutex) {
+        CloseHandle(g_instanceMutex);
+        g_instanceMutex = NULL;
+    }
+
+    if (!InitToggleRuntime(g_trayMode)) return 1;
+    ReplayRestoreJournal();
+
+    if (!g_trayMode) {
+        ExecuteToggleAction();
+        ShutdownToggleRuntime();
+        if (!setState) return 0;
+        return g_lastToggleMetrics.succeeded ? GetTaskbarStateExitCode() : EXIT_TASKBAR_FAILED;
+    }
+    WNDCLASSEXW wcex = { sizeof(WNDCLASSEXW) };
+    wcex.lpfnWndProc = WndProc;
+    wcex.hInstance = hInstance;
+    wcex.lpszClassName = WINDOW_CLASS_NAME;
+    wcex.hIcon = LoadIconW(hInstance, MAKEINTRESOURCEW(IDI_APPLICATION));
+    wcex.hCursor = LoadCursorW(nullptr, IDC_ARROW);
+
+    RegisterClassExW(&wcex);
+    // A hidden top-level window rather than a message-only one: only
+    // top-level windows receive the TaskbarCreated broadcast, which covers
+    // shell restarts this process did not start itself.
+    g_hwnd = CreateWindowExW(WS_EX_TOOLWINDOW, WINDOW_CLASS_NAME, L"Taskbar Autohide Toggle",
+        WS_POPUP, 0, 0, 0, 0,
+        NULL,
+        nullptr, hInstance, nullptr);
+
+    if (!g_hwnd) {
+        ShutdownToggleRuntime();
+        return 1;
+    }
+
+    StartTaskbarStateWatcher();
+    SetupTrayIcon(g_hwnd);
+    StartExplorerIndex();
+    if (!StartToggleWorker()) {
+        StopExplorerIndex();
+        RemoveTrayIcon();
+        StopTaskbarStateWatcher();
+        ShutdownToggleRuntime();
+        return 1;
+    }
+
+    StartToggleRules();
+
+    if (g_leanMode) {
+        SetResidentIdle(true);
+        TrimResidentMemory();
+    }
+
+    MSG msg;
+    while (GetMessage(&msg, nullptr, 0, 0)) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    StopToggleRules();
+    StopToggleWorker();
+    EndShellWatch();
+    StopExplorerIndex();
+    RemoveTrayIcon();
+    StopTaskbarStateWatcher();
+    DestroyTrayIconCache();
+    ShutdownToggleRuntime();
+    CloseHandle(g_instanceMutex);
+    return (int)msg.wParam;
+}
+
+/*
+ * Command Forwarding:
+ * Sends this launch's options to the resident instance's hidden tray
+ * window. The window may not exist yet if the resident instance is still
+ * starting, so the lookup is retried briefly. Returns false if nobody
+ * accepted the command, in which case this process toggles by itself.
+ */
+bool ForwardToResidentInstance() {
+    ForwardedCommand command = {};
+    command.size = sizeof(command);
+    command.options = g_commandLineOptions;
+
+    COPYDATASTRUCT copyData = {};
+    copyData.dwData = COPYDATA_TOGGLE_COMMAND;
+    copyData.cbData = sizeof(command);
+    copyData.lpData = &command;
+
+    ULONGLONG deadline = GetTickCount64() + FORWARD_COMMAND_TIMEOUT_MS;
+    do {
+        HWND resident = FindWindowW(WINDOW_CLASS_NAME, NULL);
+        DWORD_PTR result = 0;
+        if (resident && SendMessageTimeoutW(resident, WM_COPYDATA, 0, (LPARAM)&copyData,
+            SMTO_ABORTIFHUNG, FORWARD_COMMAND_TIMEOUT_MS, &result) && result) {
+            return true;
+        }
+        Sleep(50);
+    } while (GetTickCount64() < deadline);
+    return false;
+}
+#endif // TOGGLE_BENCHMARK
+
+// FNV-1a over a NUL-terminated string
+DWORD HashWindowString(const wchar_t* text) {
+    DWORD hash = 2166136261u;
+    for (; *text; text++) {
+        hash ^= (DWORD)*text;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+DesktopBackend& Desktop() {
+    return g_desktopBackend ? *g_desktopBackend : GetWin32DesktopBackend();
+}
+
+void SetDesktopBackend(DesktopBackend* backend) {
+    g_desktopBackend = backend;
+}
+
+DesktopWindowKey GetDesktopWindowKey(HWND hwnd) {
+    DesktopBackend& desktop = Desktop();
+    DesktopWindowKey key = {};
+    key.processId = desktop.ProcessOf(hwnd);
+    wchar_t text[256] = { 0 };
+    desktop.ClassOf(hwnd, text, ARRAYSIZE(text));
+    key.classHash = HashWindowString(text);
+    text[0] = L'\0';
+    desktop.TitleOf(hwnd, text, ARRAYSIZE(text));
+    key.titleHash = HashWindowString(text);
+    return key;
+}
+
+// Windows whose stacking the user arranged: visible, not tool or top-most.
+bool IsStackedDesktopWindow(HWND hwnd) {
+    DesktopBackend& desktop = Desktop();
+    if (!desktop.IsVisible(hwnd)) return false;
+    return (desktop.ExStyle(hwnd) & (WS_EX_TOOLWINDOW | WS_EX_TOPMOST)) == 0;
+}
+
+/*
+ * Desktop state capture:
+ * Walks the top-level Z-order once and records every stacked window plus
+ * the foreground window with its placement, to put focus and stacking back
+ * after Explorer restarts.
+ */
+DesktopSnapshot CaptureDesktopSnapshot() {
+    DesktopBackend& desktop = Desktop();
+    DesktopSnapshot snapshot = {};
+    HWND foreground = desktop.Foreground();
+    for (HWND hwnd = desktop.FirstWindow(); hwnd; hwnd = desktop.NextWindow(hwnd)) {
+        if (!IsStackedDesktopWindow(hwnd)) continue;
+        DesktopWindowRecord record = { hwnd, GetDesktopWindowKey(hwnd) };
+        snapshot.windows.push_back(record);
+    }
+
+    if (foreground) {
+        snapshot.foreground.hwnd = foreground;
+        snapshot.foreground.key = GetDesktopWindowKey(foreground);
+        snapshot.foreground.placement.length = sizeof(WINDOWPLACEMENT);
+        desktop.ReadPlacement(foreground, &snapshot.foreground.placement);
+    }
+    return snapshot;
+}
+
+/*
+ * Maps snapshot entries to live windows. The HWND is tried first (most
+ * windows survive a shell restart), then the folder-window remap, then the
+ * (pid, class, title) key against an index of the current desktop that is
+ * only built if some window actually needs it.
+ */
+class DesktopWindowResolver {
+public:
+    explicit DesktopWindowResolver(const WindowRemap& remap) : m_remap(remap), m_indexed(false) {}
+
+    HWND Resolve(HWND hwnd, const DesktopWindowKey& key) {
+        DesktopBackend& desktop = Desktop();
+        if (hwnd && desktop.IsAlive(hwnd) && desktop.ProcessOf(hwnd) == key.processId) return hwnd;
+        WindowRemap::const_iterator remapped = m_remap.find(hwnd);
+        if (remapped != m_remap.end() && desktop.IsAlive(remapped->second)) return remapped->second;
+
+        if (!m_indexed) BuildIndex();
+        DesktopWindowIndex::iterator entry = m_index.find(key);
+        if (entry == m_index.end()) return NULL;
+        HWND found = entry->second;
+        m_index.erase(entry);
+        return found;
+    }
+
+private:
+    void BuildIndex() {
+        m_indexed = true;
+        DesktopBackend& desktop = Desktop();
+        for (HWND hwnd = desktop.FirstWindow(); hwnd; hwnd = desktop.NextWindow(hwnd)) {
+            if (!desktop.IsVisible(hwnd)) continue;
+            // emplace keeps the top-most window when several share a key
+            m_index.emplace(GetDesktopWindowKey(hwnd), hwnd);
+        }
+    }
+
+    const WindowRemap& m_remap;
+    bool m_indexed;
+    DesktopWindowIndex m_index;
+};
+
+/*
+ * Desktop state restore:
+ * Puts the captured stacking back in one deferred batch, then returns focus
+ * to the window that had it.
+ */
+void RestoreDesktopSnapshot(const DesktopSnapshot& snapshot, const WindowRemap& remap) {
+    ArenaScope arena;
+    DesktopWindowResolver resolver(remap);
+    ArenaWindowList topFirst;
+    topFirst.reserve(snapshot.windows.size());
+    for (const DesktopWindowRecord& record : snapshot.windows) {
+        topFirst.push_back(resolver.Resolve(record.hwnd, record.key));
+    }
+    Desktop().ApplyZOrder(topFirst.data(), topFirst.size());
+
+    const ForegroundAppInfo& appInfo = snapshot.foreground;
+    if (!appInfo.hwnd) return;
+    HWND target = NULL;
+    for (size_t i = 0; i < snapshot.windows.size() && !target; i++) {
+        if (snapshot.windows[i].hwnd == appInfo.hwnd) target = topFirst[i];
+    }
+    if (!target) target = resolver.Resolve(appInfo.hwnd, appInfo.key);
+    if (!target) return;
+
+    int showCmd = SW_NORMAL;
+    if (appInfo.placement.showCmd == SW_SHOWMAXIMIZED) showCmd = SW_SHOWMAXIMIZED;
+    else if (appInfo.placement.showCmd == SW_SHOWMINIMIZED) showCmd = SW_RESTORE;
+    Desktop().Activate(target, showCmd);
+}
+
+/*
+ * Splits the command line once. Called from the UI thread before any
+ * worker exists, so later readers need no locking.
+ */
+void ParseCommandLineOptions() {
+    if (g_commandLineParsed) return;
+    g_commandLineParsed = true;
+
+    int argc;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv) {
+        for (int i = 1; i < argc; i++) {
+            g_commandLineArgs.push_back(argv[i]);
+        }
+        LocalFree(argv);
+    }
+    g_commandLineOptions.noReopenExplorer = HasCommandLineOption(L"--noreopenexplorer");
+    g_commandLineOptions.restartExplorer = HasCommandLineOption(L"--restartexplorer");
+    g_commandLineOptions.separateProcess = HasCommandLineOption(L"--separateprocess");
+    g_commandLineOptions.holdMinimized = HasCommandLineOption(L"--holdminimized");
+    if (HasCommandLineOption(L"--enable")) g_commandLineOptions.target = TOGGLE_TARGET_AUTOHIDE;
+    else if (HasCommandLineOption(L"--disable")) g_commandLineOptions.target = TOGGLE_TARGET_ALWAYS_VISIBLE;
+
+    const wchar_t* monitor = GetCommandLineValue(L"--monitor=");
+    if (monitor) {
+        StringCchCopyW(g_commandLineOptions.monitor, ARRAYSIZE(g_commandLineOptions.monitor), monitor);
+    }
+}
+
+bool HasCommandLineOption(const wchar_t* option) {
+    for (const std::wstring& arg : g_commandLineArgs) {
+        if (_wcsicmp(arg.c_str(), option) == 0) return true;
+    }
+    return false;
+}
+
+// Value of the last "--name=value" argument with the given prefix, or NULL.
+const wchar_t* GetCommandLineValue(const wchar_t* prefix) {
+    const wchar_t* value = NULL;
+    size_t prefixLength = wcslen(prefix);
+    for (const std::wstring& arg : g_commandLineArgs) {
+        if (_wcsnicmp(arg.c_str(), prefix, prefixLength) == 0) value = arg.c_str() + prefixLength;
+    }
+    return value;
+}
+
+/*
+ * Returns the visibility byte (TASKBAR_AUTOHIDE / TASKBAR_ALWAYS_VISIBLE).
+ * In tray mode this is a memory read of the cache kept by the registry
+ * watcher; otherwise the state is read directly.
+ */
+BYTE GetCurrentTaskbarSetting() {
+    LONG cached = g_cachedTaskbarSetting;
+    if (cached >= 0) return (BYTE)cached;
+    return ReadTaskbarSetting();
+}
+
+/*
+╔═══════════════════════════════════════════════════════════════════════════════╗
+║ StuckRects3 "Settings" Binary Structure Map (size declared at 0x00)           ║
+╠═══════════════════════════════════════════════════════════════════════════════╣
+║ Offset │ Size │ Purpose                                                       ║
+╠════════╪══════╪═══════════════════════════════════════════════════════════════╣
+║ 0x00   │ 4    │ Declared structure size (typically 0x30,0x00,0x00,0x00)       ║
+║ 0x04   │ 4    │ Reserved for internal Windows use                             ║
+║ 0x08   │ 1    │ ► Visibility control flag:                                    ║
+║        │      │ • 0x02 = Always visible (standard configuration)              ║
+║        │      │ • 0x03 = Auto-hide enabled                                    ║
+║ 0x09   │ 3    │ Reserved for future use                                       ║
+║ 0x0C   │ 4    │ Docked edge (0=left, 1=top, 2=right, 3=bottom)                ║
+║ 0x10   │ 8    │ Taskbar size (width, height)                                  ║
+║ 0x18   │ 16   │ Taskbar RECT in screen coordinates                            ║
+║ 0x28   │ …    │ Additional configuration data, up to the declared size        ║
+╚════════╧══════╧═══════════════════════════════════════════════════════════════╝
+*/
+
+/*
+ * StuckRects Accessor:
+ * Resolves StuckRects3 (or StuckRects2 on older builds) once, and in tray
+ * mode keeps the key handle open for the lifetime of the process. Blobs
+ * are length- and header-checked before any field is read or written.
+ */
+const wchar_t* ResolveStuckRectsKeyPath() {
+    static const wchar_t* resolvedPath = NULL;
+    if (resolvedPath) return resolvedPath;
+
+    const wchar_t* candidates[] = {
+        L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects3",
+        L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects2"
+    };
+    for (const wchar_t* candidate : candidates) {
+        HKEY hKey;
+        if (RegOpenKeyExW(HKEY_CURRENT_USER, candidate, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+            RegCloseKey(hKey);
+            resolvedPath = candidate;
+            break;
+        }
+    }
+    return resolvedPath;
+}
+
+bool InitStuckRects(bool keepOpen) {
+    const wchar_t* keyPath = ResolveStuckRectsKeyPath();
+    if (!keyPath) return false;
+    if (!keepOpen || g_stuckRectsKey) return true;
+    return RegOpenKeyExW(HKEY_CURRENT_USER, keyPath, 0, KEY_READ | KEY_WRITE, &g_stuckRectsKey) == ERROR_SUCCESS;
+}
+
+void CloseStuckRects() {
+    if (g_stuckRectsKey) {
+        RegCloseKey(g_stuckRectsKey);
+        g_stuckRectsKey = NULL;
+    }
+}
+
+// Returns the cached handle, or opens a temporary one the caller releases.
+HKEY AcquireStuckRectsKey() {
+    if (g_stuckRectsKey) return g_stuckRectsKey;
+    const wchar_t* keyPath = ResolveStuckRectsKeyPath();
+    if (!keyPath) return NULL;
+    HKEY hKey;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, keyPath, 0, KEY_READ | KEY_WRITE, &hKey) != ERROR_SUCCESS) return NULL;
+    return hKey;
+}
+
+void ReleaseStuckRectsKey(HKEY hKey) {
+    if (hKey && hKey != g_stuckRectsKey) RegCloseKey(hKey);
+}
+
+bool StuckRectsBlob::IsValid() const {
+    if (size < STUCKRECTS_MIN_SIZE || size > sizeof(data)) return false;
+    DWORD header;
+    memcpy(&header, data, sizeof(header));
+    return header >= STUCKRECTS_MIN_SIZE && header <= size;
+}
+
+bool StuckRectsBlob::IsAutohide() const {
+    return (data[STUCKRECTS_OFFSET_VISIBILITY] & STUCKRECTS_FLAG_AUTOHIDE) != 0;
+}
+
+void StuckRectsBlob::SetAutohide(bool enable) {
+    if (enable) data[STUCKRECTS_OFFSET_VISIBILITY] |= STUCKRECTS_FLAG_AUTOHIDE;
+    else data[STUCKRECTS_OFFSET_VISIBILITY] &= ~STUCKRECTS_FLAG_AUTOHIDE;
+}
+
+bool ReadStuckRectsBlob(HKEY hKey, const wchar_t* valueName, StuckRectsBlob& blob) {
+    DWORD type = 0;
+    blob.size = sizeof(blob.data);
+    LONG result = RegQueryValueExW(hKey, valueName, NULL, &type, blob.data, &blob.size);
+    return result == ERROR_SUCCESS && type == REG_BINARY && blob.IsValid();
+}
+
+bool WriteStuckRectsBlob(HKEY hKey, const wchar_t* valueName, const StuckRectsBlob& blob) {
+    if (!blob.IsValid()) return false;
+    return RegSetValueExW(hKey, valueName, 0, REG_BINARY, blob.data, blob.size) == ERROR_SUCCESS;
+}
+
+bool ReadStuckRects(StuckRectsBlob& blob) {
+    HKEY hKey = AcquireStuckRectsKey();
+    if (!hKey) return false;
+    bool ok = ReadStuckRectsBlob(hKey, L"Settings", blob);
+    ReleaseStuckRectsKey(hKey);
+    return ok;
+}
+
+bool WriteStuckRects(const StuckRectsBlob& blob) {
+    HKEY hKey = AcquireStuckRectsKey();
+    if (!hKey) return false;
+    bool ok = WriteStuckRectsBlob(hKey, L"Settings", blob);
+    ReleaseStuckRectsKey(hKey);
+    return ok;
+}
+
+BYTE ReadTaskbarSetting() {
+    // The running shell is authoritative; StuckRects is only flushed by Explorer
+    // some time after a live change, so read it only when there is no taskbar.
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    if (trayHwnd) {
+        APPBARDATA abd = { sizeof(APPBARDATA) };
+        abd.hWnd = trayHwnd;
+        UINT_PTR state = SHAppBarMessage(ABM_GETSTATE, &abd);
+        return (state & ABS_AUTOHIDE) ? TASKBAR_AUTOHIDE : TASKBAR_ALWAYS_VISIBLE;
+    }
+
+    StuckRectsBlob blob;
+    if (!ReadStuckRects(blob)) return TASKBAR_ALWAYS_VISIBLE; // Default
+    return blob.IsAutohide() ? TASKBAR_AUTOHIDE : TASKBAR_ALWAYS_VISIBLE;
+}
+
+/*
+ * Secondary taskbars keep their own blob per monitor under MMStuckRects3
+ * (MMStuckRects2 next to StuckRects2), as one value per monitor.
+ */
+const wchar_t* ResolveMMStuckRectsKeyPath() {
+    const wchar_t* keyPath = ResolveStuckRectsKeyPath();
+    if (!keyPath) return NULL;
+    size_t length = wcslen(keyPath);
+    return keyPath[length - 1] == L'2'
+        ? L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\MMStuckRects2"
+        : L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\MMStuckRects3";
+}
+
+/*
+ * Whether a set request has nothing to do. A flip never has. ABM_GETSTATE
+ * reports the primary taskbar only, so a request for one secondary
+ * monitor reads that monitor's blob instead.
+ */
+bool IsTaskbarTargetReached(ToggleTarget target, const wchar_t* monitor) {
+    if (target == TOGGLE_TARGET_FLIP) return false;
+    bool wantAutohide = target == TOGGLE_TARGET_AUTOHIDE;
+    if (monitor[0] == L'\0' || _wcsicmp(monitor, L"primary") == 0) {
+        return (ReadTaskbarSetting() == TASKBAR_AUTOHIDE) == wantAutohide;
+    }
+
+    bool reached = false;
+    HKEY mmKey = NULL;
+    const wchar_t* mmKeyPath = ResolveMMStuckRectsKeyPath();
+    if (mmKeyPath && RegOpenKeyExW(HKEY_CURRENT_USER, mmKeyPath, 0, KEY_READ, &mmKey) == ERROR_SUCCESS) {
+        StuckRectsBlob blob;
+        reached = ReadStuckRectsBlob(mmKey, monitor, blob) && blob.IsAutohide() == wantAutohide;
+        RegCloseKey(mmKey);
+    }
+    return reached;
+}
+
+int GetTaskbarStateExitCode() {
+    return ReadTaskbarSetting() == TASKBAR_AUTOHIDE ? EXIT_TASKBAR_AUTOHIDE : EXIT_TASKBAR_ALWAYS_VISIBLE;
+}
+
+/*
+ * Registry Toggle:
+ * Updates the primary blob and every per-monitor blob in one pass, so a
+ * single TraySettings broadcast and a single restart cover all taskbars.
+ * monitor selects one taskbar instead: "primary", or the name of a value
+ * under MMStuckRects3. An empty string means all of them. For a flip the
+ * new state is the inverse of the first selected blob; otherwise it is the
+ * target. All selected blobs are set to it so they cannot drift apart.
+ * transaction receives the original of every blob that was written.
+ */
+bool ToggleTaskbarSetting(const wchar_t* monitor, ToggleTarget target, StuckRectsTransaction& transaction) {
+    StageTimer writeTimer(STAGE_REGISTRY_WRITE);
+    bool allMonitors = monitor[0] == L'\0';
+    bool primaryOnly = _wcsicmp(monitor, L"primary") == 0;
+    bool haveState = target != TOGGLE_TARGET_FLIP;
+    bool enableAutohide = target == TOGGLE_TARGET_AUTOHIDE;
+    DWORD written = 0;
+
+    HKEY hKey = AcquireStuckRectsKey();
+    if (hKey && (allMonitors || primaryOnly)) {
+        StuckRectsBlob blob;
+        if (ReadStuckRectsBlob(hKey, L"Settings", blob)) {
+            StuckRectsUndoEntry undo = { false, L"Settings", blob };
+            if (!haveState) {
+                enableAutohide = !blob.IsAutohide();
+                haveState = true;
+            }
+            blob.SetAutohide(enableAutohide);
+            if (WriteStuckRectsBlob(hKey, L"Settings", blob)) {
+                transaction.entries.push_back(undo);
+                transaction.includesPrimary = true;
+                written++;
+            }
+        }
+    }
+    ReleaseStuckRectsKey(hKey);
+
+    HKEY mmKey = NULL;
+    const wchar_t* mmKeyPath = ResolveMMStuckRectsKeyPath();
+    if (!primaryOnly && mmKeyPath &&
+        RegOpenKeyExW(HKEY_CURRENT_USER, mmKeyPath, 0, KEY_READ | KEY_WRITE, &mmKey) == ERROR_SUCCESS) {
+        for (DWORD index = 0;; index++) {
+            wchar_t valueName[256];
+            DWORD valueNameLength = ARRAYSIZE(valueName);
+            StuckRectsBlob blob;
+            blob.size = sizeof(blob.data);
+            DWORD type = 0;
+            LONG result = RegEnumValueW(mmKey, index, valueName, &valueNameLength, NULL, &type,
+                blob.data, &blob.size);
+            if (result == ERROR_NO_MORE_ITEMS) break;
+            if (result != ERROR_SUCCESS || type != REG_BINARY || !blob.IsValid()) continue;
+            if (!allMonitors && _wcsicmp(valueName, monitor) != 0) continue;
+
+            if (!haveState) {
+                enableAutohide = !blob.IsAutohide();
+                haveState = true;
+            }
+            StuckRectsUndoEntry undo = { true, valueName, blob };
+            blob.SetAutohide(enableAutohide);
+            if (WriteStuckRectsBlob(mmKey, valueName, blob)) {
+                transaction.entries.push_back(undo);
+                written++;
+            }
+        }
+        RegCloseKey(mmKey);
+    }
+    writeTimer.Stop();
+    transaction.enableAutohide = enableAutohide;
+    if (written == 0) return false;
+
+    StageTimer broadcastTimer(STAGE_SETTING_BROADCAST);
+    SendMessageTimeoutW(HWND_BROADCAST, WM_SETTINGCHANGE, 0,
+        (LPARAM)L"TraySettings", SMTO_ABORTIFHUNG, 1000, NULL);
+
+    return true;
+}
+
+/*
+ * Checks the restarted shell against the transaction. Only the primary
+ * taskbar state can be queried live (ABM_GETSTATE is global), so a
+ * secondary-only toggle is taken as applied.
+ */
+bool VerifyTaskbarSetting(const StuckRectsTransaction& transaction) {
+    if (!transaction.includesPrimary) return true;
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    if (!trayHwnd) return false;
+
+    APPBARDATA abd = { sizeof(APPBARDATA) };
+    abd.hWnd = trayHwnd;
+    UINT_PTR state = SHAppBarMessage(ABM_GETSTATE, &abd);
+    return ((state & ABS_AUTOHIDE) != 0) == transaction.enableAutohide;
+}
+
+/*
+ * Sets the auto-hide flag of every blob in the transaction again, once the
+ * old shell is gone. The rest of each blob is re-read first, since the
+ * exiting shell may have saved a new position or size into it. No
+ * broadcast: there is no shell to hear it, and the next one reads the key.
+ */
+void ReapplyTaskbarSetting(const StuckRectsTransaction& transaction) {
+    if (transaction.rolledBack || transaction.entries.empty()) return;
+
+    HKEY hKey = AcquireStuckRectsKey();
+    HKEY mmKey = NULL;
+    const wchar_t* mmKeyPath = ResolveMMStuckRectsKeyPath();
+    if (mmKeyPath) RegOpenKeyExW(HKEY_CURRENT_USER, mmKeyPath, 0, KEY_READ | KEY_WRITE, &mmKey);
+    for (const StuckRectsUndoEntry& entry : transaction.entries) {
+        HKEY target = entry.perMonitor ? mmKey : hKey;
+        StuckRectsBlob blob;
+        if (!target || !ReadStuckRectsBlob(target, entry.valueName.c_str(), blob)) continue;
+        if (blob.IsAutohide() == transaction.enableAutohide) continue;
+        blob.SetAutohide(transaction.enableAutohide);
+        WriteStuckRectsBlob(target, entry.valueName.c_str(), blob);
+    }
+    if (mmKey) RegCloseKey(mmKey);
+    ReleaseStuckRectsKey(hKey);
+}
+
+// Writes back every original blob of the transaction and announces it.
+void RollbackTaskbarSetting(StuckRectsTransaction& transaction) {
+    if (transaction.rolledBack || transaction.entries.empty()) return;
+    transaction.rolledBack = true;
+
+    HKEY hKey = AcquireStuckRectsKey();
+    HKEY mmKey = NULL;
+    const wchar_t* mmKeyPath = ResolveMMStuckRectsKeyPath();
+    if (mmKeyPath) RegOpenKeyExW(HKEY_CURRENT_USER, mmKeyPath, 0, KEY_WRITE, &mmKey);
+    for (const StuckRectsUndoEntry& entry : transaction.entries) {
+        HKEY target = entry.perMonitor ? mmKey : hKey;
+        if (target) WriteStuckRectsBlob(target, entry.valueName.c_str(), entry.original);
+    }
+    if (mmKey) RegCloseKey(mmKey);
+    ReleaseStuckRectsKey(hKey);
+
+    SendMessageTimeoutW(HWND_BROADCAST, WM_SETTINGCHANGE, 0,
+        (LPARAM)L"TraySettings", SMTO_ABORTIFHUNG, 1000, NULL);
+}
+
+/*
+ * Taskbar State Watcher:
+ * A thread-pool wait on RegNotifyChangeKeyValue over the StuckRects key
+ * keeps g_cachedTaskbarSetting current, including changes made through
+ * Settings or other tools, and tells the tray window to refresh its icon.
+ */
+bool ArmTaskbarStateWatcher() {
+    LONG result = RegNotifyChangeKeyValue(g_stateWatchKey, FALSE,
+        REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, g_stateWatchEvent, TRUE);
+    if (result != ERROR_SUCCESS) return false;
+    SetThreadpoolWait(g_stateWatchWait, g_stateWatchEvent, NULL);
+    return true;
+}
+
+VOID CALLBACK OnTaskbarStateChanged(PTP_CALLBACK_INSTANCE instance, PVOID context,
+    PTP_WAIT wait, TP_WAIT_RESULT waitResult) {
+    // Re-arm before reading so a change racing with the read is not lost.
+    if (g_stateWatchStopping) return;
+    ArmTaskbarStateWatcher();
+
+    LONG setting = ReadTaskbarSetting();
+    LONG previous = InterlockedExchange(&g_cachedTaskbarSetting, setting);
+    if (previous != setting && g_hwnd) PostMessage(g_hwnd, WM_TASKBARSTATECHANGED, 0, 0);
+}
+
+bool StartTaskbarStateWatcher() {
+    // The watcher shares the accessor's cached handle (KEY_READ includes KEY_NOTIFY).
+    if (!InitStuckRects(true)) return false;
+    g_stateWatchKey = g_stuckRectsKey;
+    InterlockedExchange(&g_stateWatchStopping, 0);
+
+    g_stateWatchEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    g_stateWatchWait = g_stateWatchEvent ? CreateThreadpoolWait(OnTaskbarStateChanged, NULL, NULL) : NULL;
+    if (!g_stateWatchWait || !ArmTaskbarStateWatcher()) {
+        StopTaskbarStateWatcher();
+        return false;
+    }
+
+    InterlockedExchange(&g_cachedTaskbarSetting, ReadTaskbarSetting());
+    return true;
+}
+
+void StopTaskbarStateWatcher() {
+    if (g_stateWatchWait) {
+        // A callback already past the flag check may still re-arm the wait,
+        // so it is cleared again once callbacks have drained.
+        InterlockedExchange(&g_stateWatchStopping, 1);
+        SetThreadpoolWait(g_stateWatchWait, NULL, NULL);
+        WaitForThreadpoolWaitCallbacks(g_stateWatchWait, TRUE);
+        SetThreadpoolWait(g_stateWatchWait, NULL, NULL);
+        CloseThreadpoolWait(g_stateWatchWait);
+        g_stateWatchWait = NULL;
+    }
+    g_stateWatchKey = NULL;
+    if (g_stateWatchEvent) {
+        CloseHandle(g_stateWatchEvent);
+        g_stateWatchEvent = NULL;
+    }
+    InterlockedExchange(&g_cachedTaskbarSetting, -1);
+}
+
+/*
+ * Shell Watch:
+ * Called by the toggle worker for every shell it starts. The tray window
+ * gets its own handle to the process and watches it from the UI thread.
+ */
+void NotifyShellStarting(HANDLE shellProcess) {
+    if (!g_trayMode || !g_hwnd) return;
+    HANDLE duplicate = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), shellProcess, GetCurrentProcess(), &duplicate,
+        SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, 0)) {
+        return;
+    }
+    if (!PostMessage(g_hwnd, WM_SHELLSTARTING, 0, (LPARAM)duplicate)) CloseHandle(duplicate);
+}
+
+VOID CALLBACK OnShellProcessExited(PTP_CALLBACK_INSTANCE instance, PVOID context,
+    PTP_WAIT wait, TP_WAIT_RESULT waitResult) {
+    PostMessage(g_hwnd, WM_SHELLEXITED, (WPARAM)context, 0);
+}
+
+void OnShellTrayReady() {
+    EndShellWatch();
+    SetupTrayIcon(g_hwnd);
+}
+
+void CALLBACK OnShellWindowCreated(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG idObject,
+    LONG idChild, DWORD eventThread, DWORD eventTime) {
+    if (idObject != OBJID_WINDOW || !hwnd) return;
+    wchar_t className[32];
+    if (GetClassNameW(hwnd, className, ARRAYSIZE(className)) && wcscmp(className, L"Shell_TrayWnd") == 0) {
+        OnShellTrayReady();
+    }
+}
+
+// Takes ownership of shellProcess.
+void BeginShellWatch(HANDLE shellProcess) {
+    EndShellWatch();
+    g_shellWatchProcess = shellProcess;
+    g_shellWatchGeneration++;
+
+    g_shellWatchHook = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_CREATE, NULL,
+        OnShellWindowCreated, GetProcessId(shellProcess), 0, WINEVENT_OUTOFCONTEXT);
+    g_shellWatchWait = CreateThreadpoolWait(OnShellProcessExited, (PVOID)g_shellWatchGeneration, NULL);
+    if (g_shellWatchWait) SetThreadpoolWait(g_shellWatchWait, shellProcess, NULL);
+
+    // The taskbar may already exist by the time this message is handled.
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    DWORD trayProcessId = 0;
+    if (trayHwnd) GetWindowThreadProcessId(trayHwnd, &trayProcessId);
+    if (trayProcessId && trayProcessId == GetProcessId(shellProcess)) OnShellTrayReady();
+}
+
+void EndShellWatch() {
+    if (g_shellWatchHook) {
+        UnhookWinEvent(g_shellWatchHook);
+        g_shellWatchHook = NULL;
+    }
+    if (g_shellWatchWait) {
+        SetThreadpoolWait(g_shellWatchWait, NULL, NULL);
+        WaitForThreadpoolWaitCallbacks(g_shellWatchWait, TRUE);
+        CloseThreadpoolWait(g_shellWatchWait);
+        g_shellWatchWait = NULL;
+    }
+    if (g_shellWatchProcess) {
+        CloseHandle(g_shellWatchProcess);
+        g_shellWatchProcess = NULL;
+    }
+}
+
+/*
+ * Foreground Rules:
+ * The rules file lists one image name per line (e.g. "POWERPNT.EXE");
+ * blank lines and lines starting with '#' are skipped. While a listed
+ * process is in the foreground the taskbar is auto-hidden, and once focus
+ * moves elsewhere it goes back to the state it had before. Requests are
+ * --enable / --disable style set requests, so a repeat is a no-op rather
+ * than a second restart.
+ */
+DWORD HashImageName(const wchar_t* name) {
+    DWORD hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (DWORD)towlower(*name);
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+bool AddToggleRule(const wchar_t* imageName) {
+    if (g_ruleCount >= RULE_MAX_COUNT) return false;
+    DWORD hash = HashImageName(imageName);
+    for (DWORD slot = hash & (RULE_TABLE_SIZE - 1);; slot = (slot + 1) & (RULE_TABLE_SIZE - 1)) {
+        if (g_ruleTable[slot] == hash) return true;
+        if (g_ruleTable[slot] == 0) {
+            g_ruleTable[slot] = hash;
+            g_ruleCount++;
+            return true;
+        }
+    }
+}
+
+bool MatchesToggleRule(DWORD hash) {
+    for (DWORD slot = hash & (RULE_TABLE_SIZE - 1);; slot = (slot + 1) & (RULE_TABLE_SIZE - 1)) {
+        if (g_ruleTable[slot] == hash) return true;
+        if (g_ruleTable[slot] == 0) return false;
+    }
+}
+
+bool LoadToggleRules(const wchar_t* path) {
+    FILE* file = NULL;
+    if (_wfopen_s(&file, path, L"rt, ccs=UTF-8") != 0 || !file) return false;
+    wchar_t line[MAX_PATH];
+    while (fgetws(line, ARRAYSIZE(line), file)) {
+        wchar_t* name = line;
+        while (iswspace(*name)) name++;
+        size_t length = wcslen(name);
+        while (length > 0 && iswspace(name[length - 1])) name[--length] = L'\0';
+        if (length == 0 || name[0] == L'#') continue;
+        // A full path is matched by its file name.
+        const wchar_t* fileName = wcsrchr(name, L'\\');
+        if (!AddToggleRule(fileName ? fileName + 1 : name)) break;
+    }
+    fclose(file);
+    return g_ruleCount > 0;
+}
+
+/*
+ * EVENT_SYSTEM_FOREGROUND callback. Runs for every focus change on the
+ * desktop, so it only classifies a process it has not seen last, and only
+ * arms the debounce timer when the classification flips.
+ */
+void CALLBACK OnForegroundChanged(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG idObject,
+    LONG idChild, DWORD eventThread, DWORD eventTime) {
+    if (!hwnd || idObject != OBJID_WINDOW) return;
+    DWORD processId = 0;
+    GetWindowThreadProcessId(hwnd, &processId);
+    if (processId == g_ruleForegroundProcessId) return;
+    g_ruleForegroundProcessId = processId;
+
+    bool matched = false;
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+    if (process) {
+        wchar_t image[MAX_PATH];
+        DWORD length = ARRAYSIZE(image);
+        if (QueryFullProcessImageNameW(process, 0, image, &length)) {
+            const wchar_t* fileName = wcsrchr(image, L'\\');
+            matched = MatchesToggleRule(HashImageName(fileName ? fileName + 1 : image));
+        }
+        CloseHandle(process);
+    }
+    if (matched == g_ruleForegroundMatched) return;
+    g_ruleForegroundMatched = matched;
+    // Re-armed on every flip, so focus bouncing in and out settles first.
+    SetTimer(g_hwnd, RULE_TIMER_ID, RULE_DEBOUNCE_MS, NULL);
+}
+
+/*
+ * WM_TIMER: the foreground classification has been stable for the
+ * debounce time. Engaging remembers the current state; disengaging puts
+ * it back, so a taskbar that was already auto-hidden is left alone.
+ */
+void ApplyToggleRules() {
+    KillTimer(g_hwnd, RULE_TIMER_ID);
+    if (g_ruleForegroundMatched == g_ruleEngaged) return;
+
+    ULONGLONG elapsed = GetTickCount64() - g_ruleLastToggleTick;
+    if (g_ruleLastToggleTick && elapsed < RULE_MIN_INTERVAL_MS) {
+        SetTimer(g_hwnd, RULE_TIMER_ID, (UINT)(RULE_MIN_INTERVAL_MS - elapsed), NULL);
+        return;
+    }
+
+    ToggleOptions options = g_commandLineOptions;
+    g_ruleEngaged = g_ruleForegroundMatched;
+    if (g_ruleEngaged) {
+        g_ruleRestoreAutohide = GetCurrentTaskbarSetting() == TASKBAR_AUTOHIDE;
+        if (g_ruleRestoreAutohide) return;
+        options.target = TOGGLE_TARGET_AUTOHIDE;
+    }
+    else {
+        if (g_ruleRestoreAutohide) return;
+        options.target = TOGGLE_TARGET_ALWAYS_VISIBLE;
+    }
+    g_ruleLastToggleTick = GetTickCount64();
+    QueueToggleRequest(options);
+}
+
+bool StartToggleRules() {
+    const wchar_t* path = GetCommandLineValue(L"--rules=");
+    if (!path || !LoadToggleRules(path)) return false;
+
+    g_ruleHook = SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, NULL,
+        OnForegroundChanged, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+    if (!g_ruleHook) return false;
+    // A listed application may already have focus.
+    OnForegroundChanged(g_ruleHook, EVENT_SYSTEM_FOREGROUND, GetForegroundWindow(), OBJID_WINDOW, CHILDID_SELF, 0, 0);
+    return true;
+}
+
+void StopToggleRules() {
+    if (g_ruleHook) {
+        UnhookWinEvent(g_ruleHook);
+        g_ruleHook = NULL;
+    }
+    KillTimer(g_hwnd, RULE_TIMER_ID);
+}
+
+/*
+ * Live Toggle (fast path):
+ * Flips auto-hide on the running shell with ABM_SETSTATE and reads it back
+ * with ABM_GETSTATE. Explorer persists the new state to StuckRects itself,
+ * so no restart is required when the read-back matches.
+ */
+bool ToggleTaskbarSettingLive() {
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    if (!trayHwnd) return false;
+
+    APPBARDATA abd = { sizeof(APPBARDATA) };
+    abd.hWnd = trayHwnd;
+    UINT_PTR state = SHAppBarMessage(ABM_GETSTATE, &abd);
+    return SetTaskbarAutohideLive((state & ABS_AUTOHIDE) == 0);
+}
+
+// Sets auto-hide on the running shell; true if the read-back matches.
+bool SetTaskbarAutohideLive(bool enable) {
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    if (!trayHwnd) return false;
+
+    APPBARDATA abd = { sizeof(APPBARDATA) };
+    abd.hWnd = trayHwnd;
+    UINT_PTR state = SHAppBarMessage(ABM_GETSTATE, &abd);
+    abd.lParam = enable ? (state | ABS_AUTOHIDE) : (state & ~ABS_AUTOHIDE);
+    SHAppBarMessage(ABM_SETSTATE, &abd);
+
+    UINT_PTR newState = SHAppBarMessage(ABM_GETSTATE, &abd);
+    return ((newState & ABS_AUTOHIDE) != 0) == enable;
+}
+
+/*
+ * Returns the process that owns this session's taskbar (0 if there is no
+ * shell running).
+ */
+DWORD GetShellProcessId() {
+    HWND shellHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    if (!shellHwnd) shellHwnd = GetShellWindow();
+    DWORD shellProcessId = 0;
+    if (shellHwnd) GetWindowThreadProcessId(shellHwnd, &shellProcessId);
+    return shellProcessId;
+}
+
+/*
+ * Separate-Process Folder Windows:
+ * With "Launch folder windows in a separate process" on, CabinetWClass
+ * windows live in their own explorer.exe and a shell restart leaves them
+ * alone. The setting only applies to windows opened after it was turned
+ * on, so this checks where the open windows actually live rather than
+ * trusting the registry value.
+ */
+bool FolderWindowsSurviveShellRestart() {
+    DWORD shellProcessId = GetShellProcessId();
+    if (!shellProcessId) return false;
+
+    HWND hwnd = NULL;
+    while ((hwnd = FindWindowExW(NULL, hwnd, L"CabinetWClass", NULL)) != NULL) {
+        DWORD processId = 0;
+        GetWindowThreadProcessId(hwnd, &processId);
+        if (processId == shellProcessId) return false;
+    }
+    return true;
+}
+
+// Turns the option on for folder windows opened from now on (--separateprocess).
+void EnableSeparateProcessFolders() {
+    DWORD enabled = 1;
+    RegSetKeyValueW(HKEY_CURRENT_USER, L"Software\\Microsoft\\Windows\\CurrentVersion\\Explorer\\Advanced",
+        L"SeparateProcess", REG_DWORD, &enabled, sizeof(enabled));
+}
+
+// Closes every folder window and waits for them to go away.
+void CloseFolderWindows() {
+    EnumWindows([](HWND hwnd, LPARAM lParam) -> BOOL {
+        wchar_t className[256];
+        GetClassName(hwnd, className, 256);
+        if (wcscmp(className, L"CabinetWClass") == 0) PostMessage(hwnd, WM_CLOSE, 0, 0);
+        return TRUE;
+        }, 0);
+
+    // Every destroy event re-checks whether any CabinetWClass window is left.
+    HWINEVENTHOOK destroyHook = SetWinEventHook(EVENT_OBJECT_DESTROY, EVENT_OBJECT_DESTROY,
+        NULL, WakeOnWinEvent, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+    WaitForCondition([]() { return FindWindowW(L"CabinetWClass", NULL) == NULL; },
+        FOLDER_CLOSE_TIMEOUT_MS);
+    if (destroyHook) UnhookWinEvent(destroyHook);
+}
+
+/*
+ * Shell Shutdown:
+ * Closes the folder windows (unless they run in their own process), then
+ * stops the shell process that owns this session's taskbar (gracefully
+ * first, TerminateProcess as a fallback).
+ */
+void KillExplorerProcess(bool closeFolderWindows) {
+    if (closeFolderWindows) CloseFolderWindows();
+
+    // Only the shell of this session is stopped; other users' explorer.exe
+    // processes on the same machine are left alone.
+    HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+    DWORD shellProcessId = GetShellProcessId();
+    if (!shellProcessId || shellProcessId == GetCurrentProcessId()) return;
+
+    HANDLE hProcess = OpenProcess(PROCESS_TERMINATE | SYNCHRONIZE, FALSE, shellProcessId);
+    if (!hProcess) return;
+
+    // Ask the shell to exit the way "Exit Explorer" does, so it flushes its
+    // state and the next start skips the crash-recovery path. Terminate it
+    // only if it does not comply in time.
+    DWORD waitResult = WAIT_TIMEOUT;
+    if (trayHwnd && PostMessage(trayHwnd, WM_SHELL_EXIT, 0, 0)) {
+        waitResult = WaitForSingleObject(hProcess, SHELL_GRACEFUL_EXIT_TIMEOUT_MS);
+    }
+    if (waitResult != WAIT_OBJECT_0 && TerminateProcess(hProcess, 0)) {
+        // TerminateProcess is asynchronous; the old shell is only gone once
+        // its process handle is signaled.
+        WaitForSingleObject(hProcess, SHELL_EXIT_TIMEOUT_MS);
+    }
+    CloseHandle(hProcess);
+}
+
+/*
+ * Starts a new shell and returns its process handle (NULL on failure).
+ * The caller owns the handle.
+ */
+HANDLE StartExplorerProcess() {
+    STARTUPINFOW si = { sizeof(STARTUPINFOW) };
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    ZeroMemory(&pi, sizeof(pi));
+
+    wchar_t explorerPath[MAX_PATH];
+    UINT length = GetWindowsDirectoryW(explorerPath, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH ||
+        FAILED(StringCchCatW(explorerPath, MAX_PATH, L"\\explorer.exe"))) {
+        return NULL;
+    }
+    if (CreateProcessW(explorerPath, NULL, NULL, NULL, FALSE,
+        0, NULL, NULL, &si, &pi)) {
+        CloseHandle(pi.hThread);
+        return pi.hProcess;
+    }
+    return NULL;
+}
+
+/*
+ * Shell Watchdog:
+ * The user must not be left without a shell. A failed CreateProcessW is
+ * retried, and a new shell that exits before its taskbar shows up gets
+ * the registry change rolled back before the next attempt, in case the
+ * change is what it failed on. A shell that is still running without a
+ * taskbar at the deadline is rolled back the same way. Winlogon may
+ * restart the shell on its own in the meantime, which also counts.
+ * Returns true once a taskbar is up.
+ */
+bool StartShellWithWatchdog(StuckRectsTransaction& transaction) {
+    for (int attempt = 0; attempt < SHELL_START_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            WaitForCondition([]() { return FindWindowW(L"Shell_TrayWnd", NULL) != NULL; },
+                SHELL_START_RETRY_MS);
+        }
+        if (FindWindowW(L"Shell_TrayWnd", NULL)) return true;
+
+        HANDLE shellProcess = StartExplorerProcess();
+        if (!shellProcess) continue;
+        NotifyShellStarting(shellProcess);
+        bool ready = WaitForShellReady(shellProcess);
+        bool exited = WaitForSingleObject(shellProcess, 0) == WAIT_OBJECT_0;
+        CloseHandle(shellProcess);
+        if (ready || FindWindowW(L"Shell_TrayWnd", NULL)) return true;
+
+        // The change may be what the shell is stuck on. If it is still
+        // running, starting another explorer.exe would only open a folder
+        // window in it, so this is the last attempt.
+        RollbackTaskbarSetting(transaction);
+        if (!exited) return false;
+    }
+    return false;
+}
+
+/*
+ * Shell Readiness Wait:
+ * Replaces fixed sleeps after starting explorer.exe. Each stage waits on a
+ * real signal with its own timeout:
+ * 1. Shell_TrayWnd has been created (WinEvent object creation)
+ * 2. The new shell broadcast TaskbarCreated
+ * 3. The new shell process is idle and waiting for input
+ */
+bool WaitForShellReady(HANDLE shellProcess) {
+    HWND listener = CreateShellListenerWindow();
+    g_taskbarCreatedReceived = false;
+
+    HWINEVENTHOOK createHook = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_CREATE,
+        NULL, WakeOnWinEvent, GetProcessId(shellProcess), 0, WINEVENT_OUTOFCONTEXT);
+    bool trayReady = WaitForCondition([]() { return FindWindowW(L"Shell_TrayWnd", NULL) != NULL; },
+        SHELL_TRAYWND_TIMEOUT_MS);
+    if (createHook) UnhookWinEvent(createHook);
+
+    bool taskbarCreated = false;
+    if (trayReady && listener) {
+        taskbarCreated = WaitForCondition([]() { return g_taskbarCreatedReceived; },
+            SHELL_TASKBARCREATED_TIMEOUT_MS);
+    }
+    if (listener) DestroyWindow(listener);
+
+    DWORD idle = WaitForInputIdle(shellProcess, SHELL_INPUTIDLE_TIMEOUT_MS);
+    return trayReady && (taskbarCreated || !listener) && idle == 0;
+}
+
+/*
+ * Multi-Session Mode (--allsessions, run elevated):
+ * Every session with a running shell gets its StuckRects blobs written
+ * under HKEY_USERS\<SID> and its shell terminated; Winlogon's
+ * AutoRestartShell starts a new one with the user's token, which then loads
+ * the new setting. Sessions are handled on a private thread pool capped at
+ * --maxparallel threads. Folder windows hosted by a session's shell close
+ * with it; nothing runs inside the sessions to capture them.
+ */
+struct SessionToggle {
+    DWORD sessionId;
+    DWORD shellProcessId;
+    FILETIME shellCreated;
+    std::wstring userSid;
+    ToggleTarget target;
+    bool enableAutohide;
+    bool written;
+    bool restarted;
+};
+
+bool IsSessionShell(const WTS_PROCESS_INFOW& process) {
+    return process.SessionId != 0 && process.pUserSid && process.pProcessName &&
+        _wcsicmp(process.pProcessName, L"explorer.exe") == 0;
+}
+
+/*
+ * Finds each session's shell: its oldest explorer.exe, since
+ * separate-process folder windows run in explorer.exe instances that
+ * start later.
+ */
+void CollectSessionShells(std::vector<SessionToggle>& sessions) {
+    WTS_PROCESS_INFOW* processes = NULL;
+    DWORD count = 0;
+    if (!WTSEnumerateProcessesW(WTS_CURRENT_SERVER_HANDLE, 0, 1, &processes, &count)) return;
+
+    std::map<DWORD, SessionToggle> bySession;
+    for (DWORD i = 0; i < count; i++) {
+        if (!IsSessionShell(processes[i])) continue;
+        HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processes[i].ProcessId);
+        if (!process) continue;
+        FILETIME created, exited, kernel, user;
+        bool timed = GetProcessTimes(process, &created, &exited, &kernel, &user) != FALSE;
+        CloseHandle(process);
+        if (!timed) continue;
+
+        auto existing = bySession.find(processes[i].SessionId);
+        if (existing != bySession.end() && CompareFileTime(&existing->second.shellCreated, &created) <= 0) continue;
+
+        LPWSTR sidString = NULL;
+        if (!ConvertSidToStringSidW(processes[i].pUserSid, &sidString)) continue;
+        SessionToggle session = {};
+        session.sessionId = processes[i].SessionId;
+        session.shellProcessId = processes[i].ProcessId;
+        session.shellCreated = created;
+        session.userSid = sidString;
+        LocalFree(sidString);
+        bySession[session.sessionId] = session;
+    }
+    WTSFreeMemory(processes);
+
+    for (const auto& entry : bySession) sessions.push_back(entry.second);
+}
+
+/*
+ * Writes one user's primary and per-monitor blobs, the same way
+ * ToggleTaskbarSetting() does for the current user.
+ */
+bool WriteSessionTaskbarSetting(SessionToggle& session) {
+    std::wstring explorerKey = session.userSid + L"\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\";
+    const wchar_t* candidates[] = { L"StuckRects3", L"StuckRects2" };
+    const wchar_t* keyName = NULL;
+    HKEY hKey = NULL;
+    for (const wchar_t* candidate : candidates) {
+        if (RegOpenKeyExW(HKEY_USERS, (explorerKey + candidate).c_str(), 0, KEY_READ | KEY_WRITE, &hKey) == ERROR_SUCCESS) {
+            keyName = candidate;
+            break;
+        }
+    }
+    if (!keyName) return false;
+
+    bool written = false;
+    session.enableAutohide = session.target == TOGGLE_TARGET_AUTOHIDE;
+    StuckRectsBlob blob;
+    if (ReadStuckRectsBlob(hKey, L"Settings", blob)) {
+        if (session.target == TOGGLE_TARGET_FLIP) session.enableAutohide = !blob.IsAutohide();
+        blob.SetAutohide(session.enableAutohide);
+        written = WriteStuckRectsBlob(hKey, L"Settings", blob);
+    }
+    RegCloseKey(hKey);
+    if (!written) return false;
+
+    HKEY mmKey = NULL;
+    if (RegOpenKeyExW(HKEY_USERS, (explorerKey + L"MM" + keyName).c_str(), 0, KEY_READ | KEY_WRITE, &mmKey) == ERROR_SUCCESS) {
+        for (DWORD index = 0;; index++) {
+            wchar_t valueName[256];
+            DWORD valueNameLength = ARRAYSIZE(valueName);
+            DWORD type = 0;
+            blob.size = sizeof(blob.data);
+            LONG result = RegEnumValueW(mmKey, index, valueName, &valueNameLength, NULL, &type,
+                blob.data, &blob.size);
+            if (result == ERROR_NO_MORE_ITEMS) break;
+            if (result != ERROR_SUCCESS || type != REG_BINARY || !blob.IsValid()) continue;
+            blob.SetAutohide(session.enableAutohide);
+            WriteStuckRectsBlob(mmKey, valueName, blob);
+        }
+        RegCloseKey(mmKey);
+    }
+    return true;
+}
+
+/*
+ * An explorer.exe in the session that was created after createdAfter. An
+ * older one can be a folder-window host that outlived the shell, which
+ * would pass for its replacement.
+ */
+DWORD FindSessionShell(DWORD sessionId, const FILETIME& createdAfter) {
+    WTS_PROCESS_INFOW* processes = NULL;
+    DWORD count = 0;
+    DWORD found = 0;
+    if (!WTSEnumerateProcessesW(WTS_CURRENT_SERVER_HANDLE, 0, 1, &processes, &count)) return 0;
+    for (DWORD i = 0; i < count && !found; i++) {
+        if (!IsSessionShell(processes[i]) || processes[i].SessionId != sessionId) continue;
+        HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processes[i].ProcessId);
+        if (!process) continue;
+        FILETIME created, exited, kernel, user;
+        if (GetProcessTimes(process, &created, &exited, &kernel, &user) &&
+            CompareFileTime(&created, &createdAfter) > 0) {
+            found = processes[i].ProcessId;
+        }
+        CloseHandle(process);
+    }
+    WTSFreeMemory(processes);
+    return found;
+}
+
+/*
+ * Starts a shell in the session directly, for systems that do not restart
+ * it on their own. Needs the LocalSystem account (WTSQueryUserToken).
+ */
+bool StartSessionShell(DWORD sessionId) {
+    HANDLE token = NULL;
+    if (!WTSQueryUserToken(sessionId, &token)) return false;
+
+    wchar_t explorerPath[MAX_PATH];
+    UINT length = GetWindowsDirectoryW(explorerPath, MAX_PATH);
+    bool started = false;
+    if (length > 0 && length < MAX_PATH && SUCCEEDED(StringCchCatW(explorerPath, MAX_PATH, L"\\explorer.exe"))) {
+        STARTUPINFOW si = { sizeof(STARTUPINFOW) };
+        si.lpDesktop = (LPWSTR)L"winsta0\\default";
+        PROCESS_INFORMATION pi = {};
+        if (CreateProcessAsUserW(token, explorerPath, NULL, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+            started = true;
+        }
+    }
+    CloseHandle(token);
+    return started;
+}
+
+/*
+ * Terminates the session's shell and waits for its replacement. There is
+ * no cross-session signal for a new shell, so its arrival is polled.
+ */
+bool RestartSessionShell(const SessionToggle& session) {
+    HANDLE process = OpenProcess(PROCESS_TERMINATE | SYNCHRONIZE, FALSE, session.shellProcessId);
+    if (!process) return false;
+    // Taken before the kill, so a replacement Winlogon starts at once still
+    // counts as new.
+    FILETIME terminatedAt;
+    GetSystemTimeAsFileTime(&terminatedAt);
+    // A non-zero exit code is what makes Winlogon restart the shell.
+    bool terminated = TerminateProcess(process, 1) &&
+        WaitForSingleObject(process, SHELL_EXIT_TIMEOUT_MS) == WAIT_OBJECT_0;
+    CloseHandle(process);
+    if (!terminated) return false;
+
+    ULONGLONG deadline = GetTickCount64() + SESSION_SHELL_RESTART_TIMEOUT_MS;
+    bool startedOurselves = false;
+    for (;;) {
+        if (FindSessionShell(session.sessionId, terminatedAt)) return true;
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) {
+            if (startedOurselves || !StartSessionShell(session.sessionId)) return false;
+            startedOurselves = true;
+            deadline = now + SESSION_SHELL_RESTART_TIMEOUT_MS;
+        }
+        Sleep(SESSION_SHELL_POLL_MS);
+    }
+}
+
+VOID CALLBACK ToggleSessionWork(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    SessionToggle* session = (SessionToggle*)context;
+    session->written = WriteSessionTaskbarSetting(*session);
+    if (session->written) session->restarted = RestartSessionShell(*session);
+}
+
+/*
+ * Prints one line per session to the console of whoever launched us (the
+ * executable itself is a GUI application).
+ */
+void ReportSessionResults(const std::vector<SessionToggle>& sessions) {
+    bool console = AttachConsole(ATTACH_PARENT_PROCESS) != FALSE;
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    for (const SessionToggle& session : sessions) {
+        TraceLoggingWrite(g_traceProvider, "SessionToggle",
+            TraceLoggingUInt32(session.sessionId, "SessionId"),
+            TraceLoggingBool(session.written, "Written"),
+            TraceLoggingBool(session.restarted, "Restarted"),
+            TraceLoggingBool(session.enableAutohide, "Autohide"));
+        if (!output || output == INVALID_HANDLE_VALUE) continue;
+
+        char line[256];
+        StringCchPrintfA(line, ARRAYSIZE(line), "session %lu (%ls): %s\r\n", session.sessionId,
+            session.userSid.c_str(),
+            !session.written ? "failed to write the registry" :
+            !session.restarted ? "registry written, shell did not restart" :
+            session.enableAutohide ? "auto-hide on" : "always visible");
+        DWORD written = 0;
+        WriteFile(output, line, (DWORD)strlen(line), &written, NULL);
+    }
+    if (console) FreeConsole();
+}
+
+/*
+ * Returns 0 when every session was switched, EXIT_TASKBAR_FAILED otherwise
+ * (including when no session shell was found).
+ */
+int RunAllSessionsToggle() {
+    std::vector<SessionToggle> sessions;
+    CollectSessionShells(sessions);
+    for (SessionToggle& session : sessions) session.target = g_commandLineOptions.target;
+
+    DWORD parallel = SESSION_DEFAULT_PARALLEL;
+    const wchar_t* maxParallel = GetCommandLineValue(L"--maxparallel=");
+    if (maxParallel) parallel = (DWORD)min(max(_wtoi(maxParallel), 1), SESSION_MAX_PARALLEL);
+
+    TraceLoggingRegister(g_traceProvider);
+    PTP_POOL pool = CreateThreadpool(NULL);
+    TP_CALLBACK_ENVIRON environment;
+    InitializeThreadpoolEnvironment(&environment);
+    PTP_CLEANUP_GROUP cleanupGroup = pool ? CreateThreadpoolCleanupGroup() : NULL;
+    if (cleanupGroup) {
+        SetThreadpoolThreadMaximum(pool, parallel);
+        SetThreadpoolThreadMinimum(pool, 1);
+        SetThreadpoolCallbackPool(&environment, pool);
+        SetThreadpoolCallbackCleanupGroup(&environment, cleanupGroup, NULL);
+    }
+    for (SessionToggle& session : sessions) {
+        PTP_WORK work = cleanupGroup ? CreateThreadpoolWork(ToggleSessionWork, &session, &environment) : NULL;
+        if (work) SubmitThreadpoolWork(work);
+        else ToggleSessionWork(NULL, &session, NULL);
+    }
+    if (cleanupGroup) {
+        CloseThreadpoolCleanupGroupMembers(cleanupGroup, FALSE, NULL);
+        CloseThreadpoolCleanupGroup(cleanupGroup);
+    }
+    DestroyThreadpoolEnvironment(&environment);
+    if (pool) CloseThreadpool(pool);
+
+    ReportSessionResults(sessions);
+    TraceLoggingUnregister(g_traceProvider);
+
+    bool allSucceeded = !sessions.empty();
+    for (const SessionToggle& session : sessions) {
+        if (!session.written || !session.restarted) allSucceeded = false;
+    }
+    return allSucceeded ? 0 : EXIT_TASKBAR_FAILED;
+}
+
+/*
+ * Resolves the folder shown by one shell window:
+ * IWebBrowserApp -> IShellBrowser -> IShellView -> IFolderView -> IPersistFolder2
+ * The PIDL is kept as is, so virtual folders resolve as well as file system ones.
+ */
+bool GetShellWindowFolder(IWebBrowserApp* webApp, FolderId& folder) {
+    CComPtr<IServiceProvider> sp;
+    HRESULT hr = webApp->QueryInterface(IID_IServiceProvider, (void**)&sp);
+    if (FAILED(hr) || !sp) return false;
+
+    CComPtr<IShellBrowser> browser;
+    hr = sp->QueryService(SID_STopLevelBrowser, IID_IShellBrowser, (void**)&browser);
+    if (FAILED(hr) || !browser) return false;
+
+    CComPtr<IShellView> view;
+    hr = browser->QueryActiveShellView(&view);
+    if (FAILED(hr) || !view) return false;
+
+    CComPtr<IFolderView> folderView;
+    hr = view->QueryInterface(IID_IFolderView, (void**)&folderView);
+    if (FAILED(hr) || !folderView) return false;
+
+    CComPtr<IPersistFolder2> persistFolder;
+    hr = folderView->GetFolder(IID_IPersistFolder2, (void**)&persistFolder);
+    if (FAILED(hr) || !persistFolder) return false;
+
+    PIDLIST_ABSOLUTE pidl = NULL;
+    hr = persistFolder->GetCurFolder(&pidl);
+    if (FAILED(hr) || !pidl) return false;
+
+    folder.Attach(pidl);
+    return true;
+}
+
+/*
+ * Explorer Window Index:
+ * Enumerates IShellWindows exactly once and maps every folder window HWND
+ * to the folder it shows. Callers join this against their own window walk
+ * instead of re-scanning the shell windows for each HWND.
+ */
+ExplorerFolderIndex BuildExplorerFolderIndex() {
+    ExplorerFolderIndex index;
+    Desktop().ListFolderWindows(NULL, 0, index);
+    return index;
+}
+
+/*
+ * Explorer Index Event Sink:
+ * Serves both DShellWindowsEvents (m_hwnd == NULL) and the
+ * DWebBrowserEvents2 of one folder window. Invoke runs inside an incoming
+ * COM call, so it only posts WM_EXPLORERINDEXCHANGED and leaves the
+ * outgoing calls to the UI thread's message loop. Registration changes are
+ * coalesced into one pending re-scan; a navigation names its window in
+ * wParam so only that window is re-resolved.
+ */
+class ExplorerIndexEventSink : public IDispatch {
+public:
+    ExplorerIndexEventSink(REFIID eventsIid, HWND hwnd) : m_refCount(1), m_eventsIid(eventsIid), m_hwnd(hwnd) {}
+
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv) {
+        if (riid == IID_IUnknown || riid == IID_IDispatch || riid == m_eventsIid) {
+            *ppv = static_cast<IDispatch*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef() { return (ULONG)InterlockedIncrement(&m_refCount); }
+    STDMETHODIMP_(ULONG) Release() {
+        ULONG count = (ULONG)InterlockedDecrement(&m_refCount);
+        if (count == 0) delete this;
+        return count;
+    }
+
+    STDMETHODIMP GetTypeInfoCount(UINT* pctinfo) { *pctinfo = 0; return S_OK; }
+    STDMETHODIMP GetTypeInfo(UINT, LCID, ITypeInfo**) { return E_NOTIMPL; }
+    STDMETHODIMP GetIDsOfNames(REFIID, LPOLESTR*, UINT, LCID, DISPID*) { return E_NOTIMPL; }
+    STDMETHODIMP Invoke(DISPID dispIdMember, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) {
+        switch (dispIdMember) {
+        case DISPID_NAVIGATECOMPLETE2:
+            if (m_hwnd) PostMessage(g_hwnd, WM_EXPLORERINDEXCHANGED, (WPARAM)m_hwnd, 0);
+            break;
+        case DISPID_WINDOWREGISTERED:
+        case DISPID_WINDOWREVOKED:
+        case DISPID_ONQUIT:
+            if (InterlockedExchange(&g_explorerIndexRescanPosted, 1) == 0) {
+                PostMessage(g_hwnd, WM_EXPLORERINDEXCHANGED, 0, 0);
+            }
+            break;
+        }
+        return S_OK;
+    }
+
+private:
+    LONG m_refCount;
+    IID m_eventsIid;
+    HWND m_hwnd;
+};
+
+/*
+ * Publishes the UI thread's table for CopyExplorerIndex().
+ */
+void PublishExplorerIndex(bool valid) {
+    ExplorerFolderIndex published;
+    if (valid) {
+        for (const auto& entry : g_explorerIndexWindows) {
+            if (!entry.second.folder.Empty()) published[entry.first] = entry.second.folder;
+        }
+    }
+    AcquireSRWLockExclusive(&g_explorerIndexLock);
+    g_explorerIndexPublished.swap(published);
+    g_explorerIndexValid = valid;
+    ReleaseSRWLockExclusive(&g_explorerIndexLock);
+}
+
+void UnadviseIndexedWindow(IndexedExplorerWindow& window) {
+    if (window.connectionPoint && window.cookie) window.connectionPoint->Unadvise(window.cookie);
+    window.connectionPoint = NULL;
+    window.cookie = 0;
+}
+
+/*
+ * Starts the resident index on the UI thread. Fails while no shell is
+ * running; WM_TASKBARCREATED starts it again once one is.
+ */
+bool StartExplorerIndex() {
+    if (!g_trayMode || g_leanMode || !g_hwnd) return false;
+    StopExplorerIndex();
+
+    HRESULT hr = g_explorerIndexShellWindows.CoCreateInstance(CLSID_ShellWindows);
+    if (FAILED(hr)) return false;
+
+    CComQIPtr<IConnectionPointContainer> container(g_explorerIndexShellWindows);
+    if (!container || FAILED(container->FindConnectionPoint(DIID_DShellWindowsEvents, &g_explorerIndexConnectionPoint))) {
+        g_explorerIndexShellWindows.Release();
+        return false;
+    }
+    ExplorerIndexEventSink* sink = new ExplorerIndexEventSink(DIID_DShellWindowsEvents, NULL);
+    hr = g_explorerIndexConnectionPoint->Advise(sink, &g_explorerIndexCookie);
+    sink->Release();
+    if (FAILED(hr)) {
+        g_explorerIndexCookie = 0;
+        g_explorerIndexConnectionPoint.Release();
+        g_explorerIndexShellWindows.Release();
+        return false;
+    }
+
+    RefreshExplorerIndex(NULL);
+    return g_explorerIndexShellWindows != NULL;
+}
+
+void StopExplorerIndex() {
+    PublishExplorerIndex(false);
+    for (auto& entry : g_explorerIndexWindows) UnadviseIndexedWindow(entry.second);
+    g_explorerIndexWindows.clear();
+    if (g_explorerIndexConnectionPoint && g_explorerIndexCookie) {
+        g_explorerIndexConnectionPoint->Unadvise(g_explorerIndexCookie);
+    }
+    g_explorerIndexCookie = 0;
+    g_explorerIndexConnectionPoint.Release();
+    g_explorerIndexShellWindows.Release();
+}
+
+/*
+ * Handles WM_EXPLORERINDEXCHANGED. A navigation re-resolves one window;
+ * otherwise IShellWindows is walked to pick up new windows, subscribe to
+ * their navigation events and drop the ones that closed. A failing walk
+ * means the shell is gone, and the index stops until it is back.
+ */
+void RefreshExplorerIndex(HWND navigatedHwnd) {
+    if (!g_explorerIndexShellWindows) return;
+
+    if (navigatedHwnd) {
+        auto entry = g_explorerIndexWindows.find(navigatedHwnd);
+        if (entry == g_explorerIndexWindows.end()) return;
+        FolderId folder;
+        if (GetShellWindowFolder(entry->second.webApp, folder)) entry->second.folder = std::move(folder);
+        PublishExplorerIndex(true);
+        return;
+    }
+
+    InterlockedExchange(&g_explorerIndexRescanPosted, 0);
+    long count = 0;
+    if (FAILED(g_explorerIndexShellWindows->get_Count(&count))) {
+        StopExplorerIndex();
+        return;
+    }
+
+    std::set<HWND> seen;
+    VARIANT v;
+    V_VT(&v) = VT_I4;
+    for (long i = 0; i < count; i++) {
+        CComPtr<IDispatch> disp;
+        V_I4(&v) = i;
+        if (FAILED(g_explorerIndexShellWindows->Item(v, &disp)) || !disp) continue;
+
+        CComPtr<IWebBrowserApp> webApp;
+        if (FAILED(disp->QueryInterface(IID_IWebBrowserApp, (void**)&webApp)) || !webApp) continue;
+
+        HWND browserHwnd = NULL;
+        if (FAILED(webApp->get_HWND((SHANDLE_PTR*)&browserHwnd)) || !browserHwnd) continue;
+        seen.insert(browserHwnd);
+        if (g_explorerIndexWindows.count(browserHwnd)) continue;
+
+        IndexedExplorerWindow& window = g_explorerIndexWindows[browserHwnd];
+        window.webApp = webApp;
+        window.cookie = 0;
+        CComQIPtr<IConnectionPointContainer> container(webApp);
+        if (container && SUCCEEDED(container->FindConnectionPoint(DIID_DWebBrowserEvents2, &window.connectionPoint))) {
+            ExplorerIndexEventSink* sink = new ExplorerIndexEventSink(DIID_DWebBrowserEvents2, browserHwnd);
+            if (FAILED(window.connectionPoint->Advise(sink, &window.cookie))) window.cookie = 0;
+            sink->Release();
+        }
+        GetShellWindowFolder(webApp, window.folder);
+    }
+
+    for (auto entry = g_explorerIndexWindows.begin(); entry != g_explorerIndexWindows.end();) {
+        if (seen.count(entry->first)) {
+            ++entry;
+            continue;
+        }
+        UnadviseIndexedWindow(entry->second);
+        entry = g_explorerIndexWindows.erase(entry);
+    }
+    PublishExplorerIndex(true);
+}
+
+/*
+ * Copies the published index. Safe from any thread; returns false when
+ * no resident index is running.
+ */
+bool CopyExplorerIndex(ExplorerFolderIndex& index) {
+    AcquireSRWLockShared(&g_explorerIndexLock);
+    bool valid = g_explorerIndexValid;
+    if (valid) index = g_explorerIndexPublished;
+    ReleaseSRWLockShared(&g_explorerIndexLock);
+    return valid;
+}
+
+/*
+ * Fills in the per-window state of a folder window found in the index.
+ */
+ExplorerWindow CaptureExplorerWindow(HWND hwnd, FolderId folder, DWORD zOrder, HWND focusedWindow) {
+    ExplorerWindow window;
+    window.folder = std::move(folder);
+    window.hwnd = hwnd;
+    window.focusedHwnd = NULL;
+    window.zOrder = zOrder;
+    window.placement.length = sizeof(WINDOWPLACEMENT);
+    Desktop().ReadPlacement(hwnd, &window.placement);
+    window.position = window.placement.rcNormalPosition;
 
-    if (g_hwnd != NULL && IsWindow(g_hwnd)) {
-        PostMessage(g_hwnd, WM_TASKBARCREATED, 0, 0);
-    }
-    g_isRestartingExplorer = false;
-    g_watchdogThread = NULL;
-    return 0;
+    if (hwnd == focusedWindow) window.focusedHwnd = hwnd;
+    else window.focusedHwnd = Desktop().FocusedChild(hwnd);
+    return window;
 }
 
 /*
- * Main Action Orchestrator:
- * This function coordinates the entire toggle operation:
- * 1. Captures current foreground window and Explorer windows
- * 2. Toggles registry settings
- * 3. Restarts Explorer process
- * 4. Restores Explorer windows and focused application
- */
-void ExecuteToggleAction() {
-    ForegroundAppInfo foregroundApp = GetForegroundAppInfo();
-    bool shouldReopenExplorer = !HasCommandLineOption(L"--noreopenexplorer");
-    std::vector<ExplorerWindow> explorerWindows;
-    if (shouldReopenExplorer) explorerWindows = GetOpenExplorerWindows();
-    ToggleTaskbarSetting();
-    g_isRestartingExplorer = true;
-    if (g_trayMode && g_watchdogThread == NULL) {
-        g_watchdogThread = CreateThread(NULL, 0, WatchdogThreadProc, NULL, 0, NULL);
+ * Class checks on the window walk compare class atoms. Each distinct atom
+ * is looked up by name once per walk, and a desktop has far fewer window
+ * classes than windows, so most windows cost one GetClassWord.
+ */
+class ClassAtomMatcher {
+public:
+    explicit ClassAtomMatcher(const wchar_t* className) : m_className(className), m_count(0) {}
+
+    bool Matches(HWND hwnd) {
+        DesktopBackend& desktop = Desktop();
+        ATOM atom = desktop.ClassAtom(hwnd);
+        for (int i = 0; i < m_count; i++) {
+            if (m_atoms[i] == atom) return m_matches[i];
+        }
+        wchar_t className[256] = { 0 };
+        desktop.ClassOf(hwnd, className, ARRAYSIZE(className));
+        bool matches = wcscmp(className, m_className) == 0;
+        if (atom && m_count < (int)ARRAYSIZE(m_atoms)) {
+            m_atoms[m_count] = atom;
+            m_matches[m_count++] = matches;
+        }
+        return matches;
     }
-    KillExplorerProcess();
-    StartExplorerProcess();
-    Sleep(750);
-    if (shouldReopenExplorer) RestoreExplorerWindows(explorerWindows);
-    Sleep(500);
-    RestoreForegroundApp(foregroundApp);
-    if (g_hwnd && g_trayMode) {
-        UpdateTrayIconTooltip();
-        if (g_isRestartingExplorer) {
-            SetTimer(g_hwnd, 1234, 2000, NULL);
+
+private:
+    const wchar_t* m_className;
+    ATOM m_atoms[64];
+    bool m_matches[64];
+    int m_count;
+};
+
+std::vector<ExplorerWindow> GetOpenExplorerWindows() {
+    std::vector<ExplorerWindow> windows;
+    // The resident index turns this into a memory copy. A folder window it
+    // has not heard about yet (its registration still queued) falls back
+    // to a full IShellWindows walk, so the capture is never short.
+    ExplorerFolderIndex index;
+    bool resident = CopyExplorerIndex(index);
+    if (!resident) index = BuildExplorerFolderIndex();
+    if (!resident && index.empty()) return windows;
+    windows.reserve(index.size());
+
+    // The walk is top-most first, so windows come out sorted by Z-order.
+    // The index is a private copy: each folder moves into its record.
+    DesktopBackend& desktop = Desktop();
+    ClassAtomMatcher isFolderWindow(L"CabinetWClass");
+    HWND focusedWindow = desktop.Foreground();
+    HWND hwnd = desktop.FirstWindow();
+    DWORD zOrder = 0;
+
+    while (hwnd) {
+        if (desktop.IsVisible(hwnd) && isFolderWindow.Matches(hwnd)) {
+            auto entry = index.find(hwnd);
+            if (entry == index.end() && resident) {
+                resident = false;
+                index = BuildExplorerFolderIndex();
+                entry = index.find(hwnd);
+            }
+            if (entry != index.end()) {
+                windows.push_back(CaptureExplorerWindow(hwnd, std::move(entry->second), zOrder, focusedWindow));
+            }
         }
+        hwnd = desktop.NextWindow(hwnd);
+        zOrder++;
     }
+    return windows;
 }
 
 /*
- * Application Entry Point:
+ * DShellWindowsEvents Sink:
+ * Receives WindowRegistered notifications from the shell so the restore
+ * loop re-scans IShellWindows only when a new window has registered.
  */
-int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
-    _In_ LPWSTR lpCmdLine, _In_ int nCmdShow) {
-    UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(nCmdShow);
+class ShellWindowsEventSink : public IDispatch {
+public:
+    ShellWindowsEventSink() : m_refCount(1), m_changed(true) {}
+
+    bool TakeChanged() {
+        bool changed = m_changed;
+        m_changed = false;
+        return changed;
+    }
 
-    HRESULT hr = CoInitialize(NULL);
-    if (FAILED(hr)) return 1;
-    g_trayMode = HasCommandLineOption(L"--tray") || TRAY_MODE;
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv) {
+        if (riid == IID_IUnknown || riid == IID_IDispatch || riid == DIID_DShellWindowsEvents) {
+            *ppv = static_cast<IDispatch*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef() { return (ULONG)InterlockedIncrement(&m_refCount); }
+    STDMETHODIMP_(ULONG) Release() {
+        ULONG count = (ULONG)InterlockedDecrement(&m_refCount);
+        if (count == 0) delete this;
+        return count;
+    }
 
-    if (!g_trayMode) {
-        ExecuteToggleAction();
-        CoUninitialize();
-        return 0;
+    STDMETHODIMP GetTypeInfoCount(UINT* pctinfo) { *pctinfo = 0; return S_OK; }
+    STDMETHODIMP GetTypeInfo(UINT, LCID, ITypeInfo**) { return E_NOTIMPL; }
+    STDMETHODIMP GetIDsOfNames(REFIID, LPOLESTR*, UINT, LCID, DISPID*) { return E_NOTIMPL; }
+    STDMETHODIMP Invoke(DISPID dispIdMember, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) {
+        if (dispIdMember == DISPID_WINDOWREGISTERED) m_changed = true;
+        return S_OK;
     }
-    WM_TASKBARCREATED = RegisterWindowMessageW(L"TaskbarCreated");
-    WNDCLASSEXW wcex = { sizeof(WNDCLASSEXW) };
-    wcex.lpfnWndProc = WndProc;
-    wcex.hInstance = hInstance;
-    wcex.lpszClassName = L"ToggleTaskbarAutohideClass";
-    wcex.hIcon = LoadIconW(hInstance, MAKEINTRESOURCEW(IDI_APPLICATION));
-    wcex.hCursor = LoadCursorW(nullptr, IDC_ARROW);
 
-    RegisterClassExW(&wcex);
-    g_hwnd = CreateWindowW(L"ToggleTaskbarAutohideClass", L"Taskbar Autohide Toggle",
-        WS_OVERLAPPED, CW_USEDEFAULT, 0, 0, 0,
-        HWND_MESSAGE,
-        nullptr, hInstance, nullptr);
+    void MarkChanged() { m_changed = true; }
 
-    if (!g_hwnd) {
-        CoUninitialize();
-        return 1;
-    }
+private:
+    LONG m_refCount;
+    bool m_changed;
+};
 
-    SetupTrayIcon(g_hwnd);
+// Title changes of shell windows (navigation completing) also warrant a re-scan.
+ShellWindowsEventSink* g_restoreSink = NULL;
 
-    MSG msg;
-    while (GetMessage(&msg, nullptr, 0, 0)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+void CALLBACK OnFolderWindowEvent(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG idObject,
+    LONG idChild, DWORD eventThread, DWORD eventTime) {
+    if (g_restoreSink && idObject == OBJID_WINDOW) g_restoreSink->MarkChanged();
+}
+
+/*
+ * Window Placement:
+ * The captured WINDOWPLACEMENT is applied in a single call, so each window
+ * is shown once in its final state. GetWindowPlacement reports minimized
+ * windows as SW_SHOWMINIMIZED; they come back without taking activation,
+ * as do normal windows. Z-order is applied afterwards by
+ * RestoreDesktopSnapshot() for the whole desktop at once.
+ */
+void ApplyExplorerWindowPlacement(HWND newHwnd, const ExplorerWindow& window) {
+    WINDOWPLACEMENT placement = window.placement;
+    placement.length = sizeof(WINDOWPLACEMENT);
+    switch (placement.showCmd) {
+    case SW_SHOWMINIMIZED:
+    case SW_MINIMIZE:
+    case SW_SHOWMINNOACTIVE:
+        placement.showCmd = SW_SHOWMINNOACTIVE;
+        break;
+    case SW_SHOWMAXIMIZED:
+        break;
+    default:
+        placement.showCmd = SW_SHOWNOACTIVATE;
+        break;
     }
+    Desktop().WritePlacement(newHwnd, &placement);
+}
 
-    RemoveTrayIcon();
-    CoUninitialize();
-    return (int)msg.wParam;
+/*
+ * Rebuilds a stacking order in one DeferWindowPos batch. topFirst lists
+ * the windows top-most first; NULL entries (windows that could not be
+ * found again) are skipped.
+ */
+void ApplyWindowZOrder(const HWND* topFirst, size_t count) {
+    int windows = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (topFirst[i]) windows++;
+    }
+    if (windows == 0) return;
+
+    HDWP batch = BeginDeferWindowPos(windows);
+    HWND insertAfter = HWND_TOP;
+    for (size_t i = 0; i < count; i++) {
+        HWND hwnd = topFirst[i];
+        if (!hwnd || !batch) continue;
+        batch = DeferWindowPos(batch, hwnd, insertAfter, 0, 0, 0, 0,
+            SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+        insertAfter = hwnd;
+    }
+    if (batch) EndDeferWindowPos(batch);
 }
 
 /*
- * Foreground window state capture:
- * Captures detailed information about the currently active window
- * to restore focus after Explorer restarts
+ * The real desktop: user32 for the window walk, IShellWindows for folder
+ * windows and ShellExecuteExW to open them. During a folder watch the
+ * shell's DShellWindowsEvents and the name changes of its windows wake the
+ * wait, so folders are only re-listed when something has registered or
+ * finished navigating. The watch's collection serves ListFolderWindows on
+ * the watching thread only; other threads create their own.
  */
-ForegroundAppInfo GetForegroundAppInfo() {
-    ForegroundAppInfo info = {};
-    info.hwnd = GetForegroundWindow();
+class Win32DesktopBackend : public DesktopBackend {
+public:
+    Win32DesktopBackend() : m_sink(NULL), m_cookie(0), m_hook(NULL), m_watchThread(0) {}
+
+    HWND FirstWindow() { return GetTopWindow(NULL); }
+    HWND NextWindow(HWND hwnd) { return GetWindow(hwnd, GW_HWNDNEXT); }
+    bool IsAlive(HWND hwnd) { return IsWindow(hwnd) != FALSE; }
+    bool IsVisible(HWND hwnd) { return IsWindowVisible(hwnd) != FALSE; }
+    LONG_PTR ExStyle(HWND hwnd) { return GetWindowLongPtrW(hwnd, GWL_EXSTYLE); }
+    DWORD ProcessOf(HWND hwnd) {
+        DWORD processId = 0;
+        GetWindowThreadProcessId(hwnd, &processId);
+        return processId;
+    }
+    int ClassOf(HWND hwnd, wchar_t* text, int length) { return GetClassNameW(hwnd, text, length); }
+    ATOM ClassAtom(HWND hwnd) { return (ATOM)GetClassWord(hwnd, GCW_ATOM); }
+    int TitleOf(HWND hwnd, wchar_t* text, int length) { return GetWindowTextW(hwnd, text, length); }
+    bool ReadPlacement(HWND hwnd, WINDOWPLACEMENT* placement) { return GetWindowPlacement(hwnd, placement) != FALSE; }
+    bool WritePlacement(HWND hwnd, const WINDOWPLACEMENT* placement) { return SetWindowPlacement(hwnd, placement) != FALSE; }
+    HWND Foreground() { return GetForegroundWindow(); }
+    HWND FocusedChild(HWND top) {
+        HWND focus = GetFocus();
+        return focus && IsChild(top, focus) ? focus : NULL;
+    }
+    void ApplyZOrder(const HWND* topFirst, size_t count) { ApplyWindowZOrder(topFirst, count); }
+    void InsertBelow(const HWND* windows, const HWND* above, size_t count) {
+        if (count == 0) return;
+        HDWP batch = BeginDeferWindowPos((int)count);
+        for (size_t i = 0; i < count && batch; i++) {
+            batch = DeferWindowPos(batch, windows[i], above[i], 0, 0, 0, 0,
+                SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+        }
+        if (batch) EndDeferWindowPos(batch);
+    }
+    HMONITOR MonitorOf(HWND hwnd, DWORD flags) { return MonitorFromWindow(hwnd, flags); }
+    void Activate(HWND hwnd, int showCmd) {
+        ShowWindow(hwnd, showCmd);
+        SetForegroundWindow(hwnd);
+        SetActiveWindow(hwnd);
+        SetFocus(hwnd);
+    }
 
-    if (info.hwnd) {
-        GetWindowThreadProcessId(info.hwnd, &info.processId);
+    void ListFolderWindows(const HWND* skip, size_t skipCount, ExplorerFolderIndex& index) {
+        CComPtr<IShellWindows> shellWindows;
+        if (m_shellWindows && m_watchThread == GetCurrentThreadId()) shellWindows = m_shellWindows;
+        else if (FAILED(shellWindows.CoCreateInstance(CLSID_ShellWindows))) return;
 
-        if (info.processId) {
-            HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, info.processId);
-            if (hProcess) {
-                wchar_t executablePath[MAX_PATH] = { 0 };
-                if (GetModuleFileNameEx(hProcess, NULL, executablePath, MAX_PATH)) {
-                    info.executablePath = executablePath;
-                }
-                CloseHandle(hProcess);
-            }
-        }
+        long count = 0;
+        shellWindows->get_Count(&count);
+        VARIANT v;
+        V_VT(&v) = VT_I4;
+        for (long i = 0; i < count; i++) {
+            CComPtr<IDispatch> disp;
+            V_I4(&v) = i;
+            if (FAILED(shellWindows->Item(v, &disp)) || !disp) continue;
+
+            CComPtr<IWebBrowserApp> webApp;
+            if (FAILED(disp->QueryInterface(IID_IWebBrowserApp, (void**)&webApp)) || !webApp) continue;
 
-        wchar_t windowTitle[1024] = { 0 };
-        GetWindowText(info.hwnd, windowTitle, 1024);
-        info.windowTitle = windowTitle;
+            HWND browserHwnd = NULL;
+            if (FAILED(webApp->get_HWND((SHANDLE_PTR*)&browserHwnd)) || !browserHwnd) continue;
+            if (skip && std::binary_search(skip, skip + skipCount, browserHwnd)) continue;
 
-        info.placement.length = sizeof(WINDOWPLACEMENT);
-        GetWindowPlacement(info.hwnd, &info.placement);
+            FolderId folder;
+            if (GetShellWindowFolder(webApp, folder)) index[browserHwnd] = std::move(folder);
+        }
     }
 
-    return info;
-}
+    // Navigating to the PIDL itself skips a round trip through a parsing
+    // name, which virtual folders do not have.
+    bool OpenFolder(const FolderId& folder, int showCmd) {
+        SHELLEXECUTEINFOW execute = {};
+        execute.cbSize = sizeof(execute);
+        execute.fMask = SEE_MASK_IDLIST | SEE_MASK_FLAG_NO_UI;
+        execute.lpVerb = L"open";
+        execute.lpIDList = (void*)folder.Get();
+        execute.nShow = showCmd;
+        return ShellExecuteExW(&execute) != FALSE;
+    }
 
-void RestoreForegroundApp(const ForegroundAppInfo& appInfo) {
-    if (!appInfo.hwnd || !IsWindow(appInfo.hwnd)) {
-        HWND foundWindow = NULL;
+    bool BeginFolderWatch() {
+        if (FAILED(m_shellWindows.CoCreateInstance(CLSID_ShellWindows))) return false;
+        m_watchThread = GetCurrentThreadId();
+        m_sink = new ShellWindowsEventSink();
+        CComQIPtr<IConnectionPointContainer> container(m_shellWindows);
+        if (container && SUCCEEDED(container->FindConnectionPoint(DIID_DShellWindowsEvents, &m_connectionPoint))) {
+            if (FAILED(m_connectionPoint->Advise(m_sink, &m_cookie))) m_cookie = 0;
+        }
 
-        struct FindWindowParams {
-            HWND* resultWindow;
-            const ForegroundAppInfo* appInfo;
-        };
+        // Folder windows are created by the shell process; their title changes
+        // once navigation completes, which is when the folder can be resolved.
+        DWORD shellProcessId = 0;
+        HWND trayHwnd = FindWindowW(L"Shell_TrayWnd", NULL);
+        if (trayHwnd) GetWindowThreadProcessId(trayHwnd, &shellProcessId);
+        g_restoreSink = m_sink;
+        m_hook = SetWinEventHook(EVENT_OBJECT_SHOW, EVENT_OBJECT_NAMECHANGE,
+            NULL, OnFolderWindowEvent, shellProcessId, 0, WINEVENT_OUTOFCONTEXT);
+        return true;
+    }
 
-        FindWindowParams params = { &foundWindow, &appInfo };
+    bool WaitForFolderWindows(const std::function<bool()>& scan, DWORD timeoutMs) {
+        return WaitForCondition([&]() { return m_sink->TakeChanged() && scan(); }, timeoutMs);
+    }
 
-        EnumWindows([](HWND hwnd, LPARAM lParam) -> BOOL {
-            auto params = reinterpret_cast<FindWindowParams*>(lParam);
+    void EndFolderWatch() {
+        if (m_hook) UnhookWinEvent(m_hook);
+        m_hook = NULL;
+        g_restoreSink = NULL;
+        if (m_cookie) m_connectionPoint->Unadvise(m_cookie);
+        m_cookie = 0;
+        m_connectionPoint.Release();
+        if (m_sink) m_sink->Release();
+        m_sink = NULL;
+        m_shellWindows.Release();
+        m_watchThread = 0;
+    }
 
-            if (!IsWindowVisible(hwnd)) return TRUE;
+private:
+    CComPtr<IShellWindows> m_shellWindows;
+    CComPtr<IConnectionPoint> m_connectionPoint;
+    ShellWindowsEventSink* m_sink;
+    DWORD m_cookie;
+    HWINEVENTHOOK m_hook;
+    DWORD m_watchThread;
+};
 
-            DWORD processId = 0;
-            GetWindowThreadProcessId(hwnd, &processId);
+DesktopBackend& GetWin32DesktopBackend() {
+    static Win32DesktopBackend backend;
+    return backend;
+}
 
-            if (processId == params->appInfo->processId) {
-                wchar_t title[1024] = { 0 };
-                GetWindowText(hwnd, title, 1024);
+/*
+ * Concurrent Explorer window restore:
+ * All folder launches are issued up front. New windows are then matched to
+ * their snapshot entries as they register with the shell, so the total
+ * restore time is bounded by the slowest window instead of their sum.
+ * Returns the number of windows that were matched and placed; remap
+ * receives the new HWND of each of them. Without activate, each window is
+ * first shown minimized or normal without activation, as it was captured.
+ */
+size_t RestoreExplorerWindows(const std::vector<ExplorerWindow>& windows, WindowRemap& remap, bool activate) {
+    if (windows.empty()) return 0;
+    DesktopBackend& desktop = Desktop();
+    if (!desktop.BeginFolderWatch()) return 0;
+
+    ArenaScope arena;
+    std::vector<bool, ArenaAllocator<bool> > restored(windows.size(), false);
+    size_t pending = 0;
+    size_t launched = 0;
+    for (size_t i = windows.size(); i-- > 0;) {
+        int showCmd = SW_SHOWNORMAL;
+        if (!activate) showCmd = windows[i].placement.showCmd == SW_SHOWMINIMIZED ? SW_SHOWMINNOACTIVE : SW_SHOWNOACTIVATE;
+        if (windows[i].folder.Empty() || !desktop.OpenFolder(windows[i].folder, showCmd)) {
+            restored[i] = true;
+            continue;
+        }
+        pending++;
+        launched++;
+    }
 
-                if ((wcscmp(title, params->appInfo->windowTitle.c_str()) == 0) ||
-                    (wcsstr(title, params->appInfo->windowTitle.c_str()) != NULL &&
-                        params->appInfo->windowTitle.length() > 0)) {
-                    *(params->resultWindow) = hwnd;
-                    return FALSE;
+    // Kept sorted for ListFolderWindows()
+    ArenaWindowList claimed;
+    claimed.reserve(pending);
+    ExplorerFolderIndex found;
+    if (pending > 0) {
+        desktop.WaitForFolderWindows([&]() {
+            found.clear();
+            desktop.ListFolderWindows(claimed.data(), claimed.size(), found);
+            for (const auto& entry : found) {
+                for (size_t w = windows.size(); w-- > 0;) {
+                    if (restored[w] || !windows[w].folder.Equals(entry.second)) continue;
+                    restored[w] = true;
+                    remap[windows[w].hwnd] = entry.first;
+                    claimed.insert(std::lower_bound(claimed.begin(), claimed.end(), entry.first), entry.first);
+                    pending--;
+                    ApplyExplorerWindowPlacement(entry.first, windows[w]);
+                    break;
                 }
+                if (pending == 0) break;
             }
-            return TRUE;
-            }, reinterpret_cast<LPARAM>(&params));
+            return pending == 0;
+            }, FOLDER_WINDOW_TIMEOUT_MS);
+    }
 
-        if (foundWindow) {
-            if (appInfo.placement.showCmd == SW_SHOWMAXIMIZED) {
-                ShowWindow(foundWindow, SW_SHOWMAXIMIZED);
-            }
-            else if (appInfo.placement.showCmd == SW_SHOWMINIMIZED) {
-                ShowWindow(foundWindow, SW_RESTORE);
-            }
-            else {
-                ShowWindow(foundWindow, SW_NORMAL);
-            }
+    desktop.EndFolderWatch();
+    return launched - pending;
+}
 
-            SetForegroundWindow(foundWindow);
-            SetActiveWindow(foundWindow);
-            SetFocus(foundWindow);
-        }
+/*
+ * Restore priority:
+ * Folder windows the user can see - the foreground one, and normal or
+ * maximized windows on its monitor - are restored before focus is handed
+ * back. Minimized windows and windows on other monitors move to deferred,
+ * in their captured order. Runs before the shell is stopped, while the
+ * captured HWNDs still exist.
+ */
+void SplitDeferredExplorerWindows(std::vector<ExplorerWindow>& windows, HWND foreground,
+    std::vector<ExplorerWindow>& deferred) {
+    DesktopBackend& desktop = Desktop();
+    HMONITOR activeMonitor = desktop.MonitorOf(foreground, MONITOR_DEFAULTTOPRIMARY);
+    std::vector<ExplorerWindow> visible;
+    for (ExplorerWindow& window : windows) {
+        bool seen = window.hwnd == foreground ||
+            (window.placement.showCmd != SW_SHOWMINIMIZED &&
+                desktop.MonitorOf(window.hwnd, MONITOR_DEFAULTTONEAREST) == activeMonitor);
+        if (seen) visible.push_back(std::move(window));
+        else deferred.push_back(std::move(window));
     }
-    else {
-        if (appInfo.placement.showCmd == SW_SHOWMAXIMIZED) {
-            ShowWindow(appInfo.hwnd, SW_SHOWMAXIMIZED);
-        }
-        else if (appInfo.placement.showCmd == SW_SHOWMINIMIZED) {
-            ShowWindow(appInfo.hwnd, SW_RESTORE);
+    windows.swap(visible);
+}
+
+/*
+ * Moves the minimized windows to g_heldExplorerWindows for the tray menu.
+ * Returns how many were held.
+ */
+size_t HoldMinimizedExplorerWindows(std::vector<ExplorerWindow>& windows) {
+    std::vector<ExplorerWindow> remaining;
+    size_t held = 0;
+    AcquireSRWLockExclusive(&g_heldExplorerLock);
+    for (ExplorerWindow& window : windows) {
+        if (window.placement.showCmd == SW_SHOWMINIMIZED) {
+            g_heldExplorerWindows.push_back(std::move(window));
+            held++;
         }
         else {
-            ShowWindow(appInfo.hwnd, SW_NORMAL);
+            remaining.push_back(std::move(window));
         }
-
-        SetForegroundWindow(appInfo.hwnd);
-        SetActiveWindow(appInfo.hwnd);
-        SetFocus(appInfo.hwnd);
     }
+    ReleaseSRWLockExclusive(&g_heldExplorerLock);
+    windows.swap(remaining);
+    return held;
 }
 
-bool HasCommandLineOption(const wchar_t* option) {
-    int argc;
-    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
-    bool found = false;
-    for (int i = 1; i < argc; i++) {
-        if (_wcsicmp(argv[i], option) == 0) {
-            found = true;
-            break;
+/*
+ * Inserts windows restored after the desktop stacking was put back: each
+ * goes directly below the nearest captured window above it that still
+ * exists, so windows the user has touched since are not moved.
+ */
+void InsertRestoredWindowsIntoZOrder(const DesktopSnapshot& snapshot, const WindowRemap& remap,
+    const WindowRemap& inserted) {
+    ArenaScope arena;
+    ArenaWindowList windows;
+    ArenaWindowList below;
+    windows.reserve(inserted.size());
+    below.reserve(inserted.size());
+    DesktopWindowResolver resolver(remap);
+    HWND above = HWND_TOP;
+    for (const DesktopWindowRecord& record : snapshot.windows) {
+        WindowRemap::const_iterator entry = inserted.find(record.hwnd);
+        if (entry == inserted.end()) {
+            HWND live = resolver.Resolve(record.hwnd, record.key);
+            if (live) above = live;
+            continue;
         }
+        windows.push_back(entry->second);
+        below.push_back(above);
+        above = entry->second;
     }
-    LocalFree(argv);
-    return found;
+    Desktop().InsertBelow(windows.data(), below.data(), windows.size());
 }
 
-BYTE GetCurrentTaskbarSetting() {
-    /*
-    ╔═══════════════════════════════════════════════════════════════════════════════╗
-    ║ StuckRects3 "Settings" Binary Structure Map (64-byte serialized configuration)║
-    ╠═══════════════════════════════════════════════════════════════════════════════╣
-    ║ Offset │ Size │ Purpose                                                       ║
-    ╠════════╪══════╪═══════════════════════════════════════════════════════════════╣
-    ║ 0x00   │ 4    │ Structure version identifier (typically 0x30,0x00,0x00,0x00)  ║
-    ║ 0x04   │ 4    │ Configuration bitflags:                                       ║
-    ║        │      │ • Bit 0: Taskbar position (0=bottom, 1=top, 2=left, 3=right)  ║
-    ║        │      │ • Bits 1-31: Reserved for internal Windows use                ║
-    ║ 0x08   │ 1    │ ► Visibility control flag:                                    ║
-    ║        │      │ • 0x02 = Always visible (standard configuration)              ║
-    ║        │      │ • 0x03 = Auto-hide enabled                                    ║
-    ║ 0x09   │ 3    │ Reserved for future use                                       ║
-    ║ 0x0C   │ 16   │ Taskbar position/dimension information                        ║
-    ║ 0x1C   │ 36   │ Additional configuration data                                 ║
-    ╚════════╧══════╧═══════════════════════════════════════════════════════════════╝
-    */
-    const wchar_t* keyPath = L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects3";
-    HKEY hKey;
-    LONG result = RegOpenKeyExW(HKEY_CURRENT_USER, keyPath, 0, KEY_READ, &hKey);
-    if (result != ERROR_SUCCESS) {
-        const wchar_t* altKeyPath = L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects2";
-        result = RegOpenKeyExW(HKEY_CURRENT_USER, altKeyPath, 0, KEY_READ, &hKey);
-        if (result != ERROR_SUCCESS) return TASKBAR_ALWAYS_VISIBLE; // Default
-    }
-
-    BYTE settings[64];
-    DWORD settingsSize = sizeof(settings);
-    DWORD type = REG_BINARY;
-    result = RegQueryValueExW(hKey, L"Settings", NULL, &type, settings, &settingsSize);
-    RegCloseKey(hKey);
-
-    if (result != ERROR_SUCCESS) {
-        return TASKBAR_ALWAYS_VISIBLE; 
+/*
+ * Restores the deferred folder windows at idle thread priority, so they
+ * do not compete with the window that just got focus back. They open
+ * without activation; a maximized one still takes the foreground when its
+ * placement is applied, so the window that had it is activated again.
+ * Returns the number restored; remap receives their new HWNDs.
+ */
+size_t RestoreDeferredExplorerWindows(const std::vector<ExplorerWindow>& windows,
+    const DesktopSnapshot& snapshot, WindowRemap& remap) {
+    if (windows.empty()) return 0;
+
+    DesktopBackend& desktop = Desktop();
+    HWND foreground = desktop.Foreground();
+    HANDLE thread = GetCurrentThread();
+    int priority = GetThreadPriority(thread);
+    SetThreadPriority(thread, THREAD_PRIORITY_IDLE);
+    WindowRemap deferredRemap;
+    size_t restored = RestoreExplorerWindows(windows, deferredRemap, false);
+    SetThreadPriority(thread, priority);
+
+    HWND current = desktop.Foreground();
+    if (foreground && current != foreground && desktop.IsAlive(foreground)) {
+        for (const auto& entry : deferredRemap) {
+            if (entry.second != current) continue;
+            desktop.Activate(foreground, SW_SHOW);
+            break;
+        }
     }
 
-    return settings[0x08];
+    remap.insert(deferredRemap.begin(), deferredRemap.end());
+    if (!deferredRemap.empty()) InsertRestoredWindowsIntoZOrder(snapshot, remap, deferredRemap);
+    return restored;
 }
 
-bool ToggleTaskbarSetting() {
-    const wchar_t* keyPath = L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects3";
-    HKEY hKey;
-    LONG result = RegOpenKeyExW(HKEY_CURRENT_USER, keyPath, 0, KEY_READ | KEY_WRITE, &hKey);
-    if (result != ERROR_SUCCESS) {
-        const wchar_t* altKeyPath = L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StuckRects2";
-        result = RegOpenKeyExW(HKEY_CURRENT_USER, altKeyPath, 0, KEY_READ | KEY_WRITE, &hKey);
-        if (result != ERROR_SUCCESS) return false;
-    }
-
-    BYTE settings[64];
-    DWORD settingsSize = sizeof(settings);
-    DWORD type = REG_BINARY;
-    result = RegQueryValueExW(hKey, L"Settings", NULL, &type, settings, &settingsSize);
-    if (result != ERROR_SUCCESS) {
-        RegCloseKey(hKey);
-        return false;
-    }
-
-    settings[0x08] = (settings[0x08] == TASKBAR_ALWAYS_VISIBLE) ? TASKBAR_AUTOHIDE : TASKBAR_ALWAYS_VISIBLE;
-    result = RegSetValueExW(hKey, L"Settings", 0, REG_BINARY, settings, settingsSize);
-    RegCloseKey(hKey);
-
-    SendMessageTimeoutW(HWND_BROADCAST, WM_SETTINGCHANGE, 0,
-        (LPARAM)L"TraySettings", SMTO_ABORTIFHUNG, 1000, NULL);
+/*
+ * Tray menu "Reopen minimized folders": runs on the toggle worker, under
+ * the toggle mutex so it cannot overlap a restart from another process.
+ * CoInitialize is balanced here because a --lean worker has no apartment
+ * between toggles.
+ */
+void ReopenHeldExplorerWindows() {
+    std::vector<ExplorerWindow> windows;
+    AcquireSRWLockExclusive(&g_heldExplorerLock);
+    windows.swap(g_heldExplorerWindows);
+    ReleaseSRWLockExclusive(&g_heldExplorerLock);
+    if (windows.empty()) return;
 
-    return (result == ERROR_SUCCESS);
+    HRESULT hr = CoInitialize(NULL);
+    DWORD waitResult = g_toggleMutex ? WaitForSingleObject(g_toggleMutex, INFINITE) : WAIT_FAILED;
+    WindowRemap remap;
+    RestoreExplorerWindows(windows, remap);
+    if (waitResult == WAIT_OBJECT_0 || waitResult == WAIT_ABANDONED) {
+        ReleaseMutex(g_toggleMutex);
+    }
+    if (SUCCEEDED(hr)) CoUninitialize();
 }
 
-void KillExplorerProcess() {
-    EnumWindows([](HWND hwnd, LPARAM lParam) -> BOOL {
-        wchar_t className[256];
-        GetClassName(hwnd, className, 256);
-        if (wcscmp(className, L"CabinetWClass") == 0) PostMessage(hwnd, WM_CLOSE, 0, 0);
-        return TRUE;
-        }, 0);
-
-    Sleep(150);
-
-    DWORD ourProcessId = GetCurrentProcessId();
-    HANDLE hSnapShot = CreateToolhelp32Snapshot(TH32CS_SNAPALL, 0);
-    PROCESSENTRY32 pEntry;
-    pEntry.dwSize = sizeof(pEntry);
-    BOOL hRes = Process32First(hSnapShot, &pEntry);
-    while (hRes) {
-        if (wcscmp(pEntry.szExeFile, L"explorer.exe") == 0 && pEntry.th32ProcessID != ourProcessId) {
-            HANDLE hProcess = OpenProcess(PROCESS_TERMINATE, 0, pEntry.th32ProcessID);
-            if (hProcess != NULL) {
-                TerminateProcess(hProcess, 0);
-                CloseHandle(hProcess);
+/*
+ * Renders the "always visible" variant of the tray icon: the base icon
+ * with a solid bar along its bottom edge, standing for a taskbar that
+ * stays on screen. Works on the 32-bit pixels directly, so icons without
+ * an alpha channel get one derived from their mask first.
+ */
+HICON CreateVisibleStateIcon(HICON base, int cx, int cy) {
+    ICONINFO info = {};
+    if (!GetIconInfo(base, &info)) return NULL;
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = cx;
+    bmi.bmiHeader.biHeight = -cy;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    std::vector<DWORD> color((size_t)cx * cy, 0);
+    std::vector<DWORD> mask((size_t)cx * cy, 0);
+    HDC screen = GetDC(NULL);
+    bool ok = info.hbmColor &&
+        GetDIBits(screen, info.hbmColor, 0, cy, color.data(), &bmi, DIB_RGB_COLORS) == cy &&
+        GetDIBits(screen, info.hbmMask, 0, cy, mask.data(), &bmi, DIB_RGB_COLORS) == cy;
+
+    HICON icon = NULL;
+    if (ok) {
+        bool hasAlpha = false;
+        for (DWORD pixel : color) {
+            if (pixel & 0xFF000000) {
+                hasAlpha = true;
+                break;
+            }
+        }
+        if (!hasAlpha) {
+            for (size_t i = 0; i < color.size(); i++) {
+                color[i] = (mask[i] & 0x00FFFFFF) ? 0 : (color[i] | 0xFF000000);
             }
         }
-        hRes = Process32Next(hSnapShot, &pEntry);
-    }
-    CloseHandle(hSnapShot);
-}
-
-void StartExplorerProcess() {
-    STARTUPINFOW si = { sizeof(STARTUPINFOW) };
-    PROCESS_INFORMATION pi;
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    ZeroMemory(&pi, sizeof(pi));
-    if (CreateProcessW(L"C:\\Windows\\explorer.exe", NULL, NULL, NULL, FALSE,
-        0, NULL, NULL, &si, &pi)) {
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-    }
-}
-
-std::vector<ExplorerWindow> GetOpenExplorerWindows() {
-    std::vector<ExplorerWindow> windows;
-    std::map<DWORD, ExplorerWindow> windowsByZOrder;
-    HWND focusedWindow = GetForegroundWindow();
-    HWND hwnd = GetTopWindow(NULL);
-    DWORD zOrder = 0;
-
-    while (hwnd) {
-        if (IsWindowVisible(hwnd)) {
-            wchar_t className[256];
-            GetClassName(hwnd, className, 256);
-
-            if (wcscmp(className, L"CabinetWClass") == 0) {
-                ExplorerWindow window;
-                window.hwnd = hwnd;
-                window.focusedHwnd = NULL;
-                window.zOrder = zOrder;
-                window.placement.length = sizeof(WINDOWPLACEMENT);
-                GetWindowPlacement(hwnd, &window.placement);
-                window.position = window.placement.rcNormalPosition;
-
-                if (hwnd == focusedWindow) window.focusedHwnd = hwnd;
-                else {
-                    HWND childFocus = GetFocus();
-                    if (childFocus && IsChild(hwnd, childFocus)) window.focusedHwnd = childFocus;
-                }
 
-                CComPtr<IShellWindows> shellWindows;
-                HRESULT hr = shellWindows.CoCreateInstance(CLSID_ShellWindows);
-                if (SUCCEEDED(hr)) {
-                    VARIANT v;
-                    V_VT(&v) = VT_I4;
-                    long count;
-                    shellWindows->get_Count(&count);
-
-                    for (long i = 0; i < count; i++) {
-                        CComPtr<IDispatch> disp;
-                        V_I4(&v) = i;
-                        hr = shellWindows->Item(v, &disp);
-                        if (SUCCEEDED(hr) && disp) {
-                            CComPtr<IWebBrowserApp> webApp;
-                            hr = disp->QueryInterface(IID_IWebBrowserApp, (void**)&webApp);
-                            if (SUCCEEDED(hr) && webApp) {
-                                HWND browserHwnd;
-                                webApp->get_HWND((SHANDLE_PTR*)&browserHwnd);
-                                if (browserHwnd == hwnd) {
-                                    CComPtr<IServiceProvider> sp;
-                                    hr = webApp->QueryInterface(IID_IServiceProvider, (void**)&sp);
-                                    if (SUCCEEDED(hr) && sp) {
-                                        CComPtr<IShellBrowser> browser;
-                                        hr = sp->QueryService(SID_STopLevelBrowser, IID_IShellBrowser, (void**)&browser);
-                                        if (SUCCEEDED(hr) && browser) {
-                                            CComPtr<IShellView> view;
-                                            hr = browser->QueryActiveShellView(&view);
-                                            if (SUCCEEDED(hr) && view) {
-                                                CComPtr<IFolderView> folderView;
-                                                hr = view->QueryInterface(IID_IFolderView, (void**)&folderView);
-                                                if (SUCCEEDED(hr) && folderView) {
-                                                    CComPtr<IPersistFolder2> folder;
-                                                    hr = folderView->GetFolder(IID_IPersistFolder2, (void**)&folder);
-                                                    if (SUCCEEDED(hr) && folder) {
-                                                        LPITEMIDLIST pidl;
-                                                        hr = folder->GetCurFolder(&pidl);
-                                                        if (SUCCEEDED(hr) && pidl) {
-                                                            wchar_t path[MAX_PATH];
-                                                            SHGetPathFromIDList(pidl, path);
-                                                            window.path = path;
-                                                            CoTaskMemFree(pidl);
-                                                            windowsByZOrder[zOrder] = window;
-                                                            break;
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+        int barHeight = max(2, cy / 8);
+        for (int y = cy - barHeight; y < cy; y++) {
+            for (int x = 0; x < cx; x++) {
+                color[(size_t)y * cx + x] = 0xFF0078D7;
             }
         }
-        hwnd = GetNextWindow(hwnd, GW_HWNDNEXT);
-        zOrder++;
+
+        void* bits = NULL;
+        HBITMAP colorBitmap = CreateDIBSection(screen, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+        HBITMAP maskBitmap = CreateBitmap(cx, cy, 1, 1, NULL);
+        if (colorBitmap && maskBitmap && bits) {
+            memcpy(bits, color.data(), color.size() * sizeof(DWORD));
+            ICONINFO result = { TRUE, 0, 0, maskBitmap, colorBitmap };
+            icon = CreateIconIndirect(&result);
+        }
+        if (colorBitmap) DeleteObject(colorBitmap);
+        if (maskBitmap) DeleteObject(maskBitmap);
     }
 
-    for (const auto& pair : windowsByZOrder) windows.push_back(pair.second);
-    return windows;
+    ReleaseDC(NULL, screen);
+    if (info.hbmColor) DeleteObject(info.hbmColor);
+    if (info.hbmMask) DeleteObject(info.hbmMask);
+    return icon;
 }
 
-BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam) {
-    std::vector<ExplorerWindow>* windows = reinterpret_cast<std::vector<ExplorerWindow>*>(lParam);
-    if (!IsWindowVisible(hwnd)) return TRUE;
-
-    wchar_t className[256];
-    GetClassName(hwnd, className, 256);
-    if (wcscmp(className, L"CabinetWClass") != 0) return TRUE;
+/*
+ * Per-monitor DPI APIs:
+ * GetDpiForWindow and GetSystemMetricsForDpi need Windows 10 1607, so they
+ * are resolved at runtime and the executable still loads on Windows 8.
+ * There the screen DC's DPI and GetSystemMetrics, which is already scaled
+ * for it, stand in.
+ */
+typedef UINT(WINAPI* GetDpiForWindowProc)(HWND hwnd);
+typedef int(WINAPI* GetSystemMetricsForDpiProc)(int index, UINT dpi);
 
-    ExplorerWindow window;
-    window.hwnd = hwnd;
-    window.placement.length = sizeof(WINDOWPLACEMENT);
-    GetWindowPlacement(hwnd, &window.placement);
-    window.position = window.placement.rcNormalPosition;
-    HWND focusedWindow = GetForegroundWindow();
+int GetScaledSystemMetric(int index, UINT dpi) {
+    static GetSystemMetricsForDpiProc getSystemMetricsForDpi = (GetSystemMetricsForDpiProc)GetProcAddress(
+        GetModuleHandleW(L"user32.dll"), "GetSystemMetricsForDpi");
+    return getSystemMetricsForDpi ? getSystemMetricsForDpi(index, dpi) : GetSystemMetrics(index);
+}
 
-    if (hwnd == focusedWindow) window.focusedHwnd = hwnd;
-    else {
-        HWND childFocus = GetFocus();
-        if (childFocus && IsChild(hwnd, childFocus)) window.focusedHwnd = childFocus;
-        else window.focusedHwnd = NULL;
+/*
+ * Loads IDI_ICON2 at the small-icon size for dpi and derives both state
+ * icons from it. The cache owns both handles.
+ */
+bool BuildTrayIconCache(UINT dpi) {
+    int cx = GetScaledSystemMetric(SM_CXSMICON, dpi);
+    int cy = GetScaledSystemMetric(SM_CYSMICON, dpi);
+    HINSTANCE hInstance = GetModuleHandleW(NULL);
+
+    HICON base = NULL;
+    if (FAILED(LoadIconWithScaleDown(hInstance, MAKEINTRESOURCEW(IDI_ICON2), cx, cy, &base))) {
+        base = (HICON)LoadImageW(hInstance, MAKEINTRESOURCEW(IDI_ICON2), IMAGE_ICON, cx, cy, 0);
     }
+    if (!base && FAILED(LoadIconWithScaleDown(NULL, IDI_APPLICATION, cx, cy, &base))) return false;
 
-    CComPtr<IShellWindows> shellWindows;
-    HRESULT hr = shellWindows.CoCreateInstance(CLSID_ShellWindows);
-    if (SUCCEEDED(hr)) {
-        VARIANT v;
-        V_VT(&v) = VT_I4;
-        long count;
-        shellWindows->get_Count(&count);
+    HICON visible = CreateVisibleStateIcon(base, cx, cy);
+    if (!visible) visible = CopyIcon(base);
 
-        for (long i = 0; i < count; i++) {
-            CComPtr<IDispatch> disp;
-            V_I4(&v) = i;
-            hr = shellWindows->Item(v, &disp);
-            if (SUCCEEDED(hr) && disp) {
-                CComPtr<IWebBrowserApp> webApp;
-                hr = disp->QueryInterface(IID_IWebBrowserApp, (void**)&webApp);
-                if (SUCCEEDED(hr) && webApp) {
-                    HWND browserHwnd;
-                    webApp->get_HWND((SHANDLE_PTR*)&browserHwnd);
-                    if (browserHwnd == hwnd) {
-                        CComPtr<IServiceProvider> sp;
-                        hr = webApp->QueryInterface(IID_IServiceProvider, (void**)&sp);
-                        if (SUCCEEDED(hr) && sp) {
-                            CComPtr<IShellBrowser> browser;
-                            hr = sp->QueryService(SID_STopLevelBrowser, IID_IShellBrowser, (void**)&browser);
-                            if (SUCCEEDED(hr) && browser) {
-                                CComPtr<IShellView> view;
-                                hr = browser->QueryActiveShellView(&view);
-                                if (SUCCEEDED(hr) && view) {
-                                    CComPtr<IFolderView> folderView;
-                                    hr = view->QueryInterface(IID_IFolderView, (void**)&folderView);
-                                    if (SUCCEEDED(hr) && folderView) {
-                                        CComPtr<IPersistFolder2> folder;
-                                        hr = folderView->GetFolder(IID_IPersistFolder2, (void**)&folder);
-                                        if (SUCCEEDED(hr) && folder) {
-                                            LPITEMIDLIST pidl;
-                                            hr = folder->GetCurFolder(&pidl);
-                                            if (SUCCEEDED(hr) && pidl) {
-                                                wchar_t path[MAX_PATH];
-                                                SHGetPathFromIDList(pidl, path);
-                                                window.path = path;
-                                                CoTaskMemFree(pidl);
-                                                windows->push_back(window);
-                                                break;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
-    return TRUE;
-}
-
-void RestoreExplorerWindows(const std::vector<ExplorerWindow>& windows) {
-    std::map<std::wstring, HWND> openedPaths;
-    for (auto it = windows.rbegin(); it != windows.rend(); ++it) {
-        const auto& window = *it;
-        if (!window.path.empty()) {
-            ShellExecuteW(NULL, L"open", L"explorer.exe", window.path.c_str(), NULL, SW_SHOWNORMAL);
-            Sleep(500);
-            HWND newHwnd = NULL;
-            struct FindParams {
-                HWND* result;
-                const std::wstring* targetPath;
-            };
-            FindParams findParams = { &newHwnd, &window.path };
-            EnumWindows([](HWND hwnd, LPARAM lParam) -> BOOL {
-                FindParams* params = reinterpret_cast<FindParams*>(lParam);
-                wchar_t className[256];
-                GetClassName(hwnd, className, 256);
-                if (wcscmp(className, L"CabinetWClass") == 0 && IsWindowVisible(hwnd)) {
-                    std::wstring path;
-                    CComPtr<IShellWindows> shellWindows;
-                    HRESULT hr = shellWindows.CoCreateInstance(CLSID_ShellWindows);
-                    if (SUCCEEDED(hr)) {
-                        VARIANT v;
-                        V_VT(&v) = VT_I4;
-                        long count;
-                        shellWindows->get_Count(&count);
-                        for (long i = 0; i < count; i++) {
-                            CComPtr<IDispatch> disp;
-                            V_I4(&v) = i;
-                            hr = shellWindows->Item(v, &disp);
-                            if (SUCCEEDED(hr) && disp) {
-                                CComPtr<IWebBrowserApp> webApp;
-                                hr = disp->QueryInterface(IID_IWebBrowserApp, (void**)&webApp);
-                                if (SUCCEEDED(hr) && webApp) {
-                                    HWND browserHwnd;
-                                    webApp->get_HWND((SHANDLE_PTR*)&browserHwnd);
-                                    if (browserHwnd == hwnd) {
-                                        CComPtr<IServiceProvider> sp;
-                                        hr = webApp->QueryInterface(IID_IServiceProvider, (void**)&sp);
-                                        if (SUCCEEDED(hr) && sp) {
-                                            CComPtr<IShellBrowser> browser;
-                                            hr = sp->QueryService(SID_STopLevelBrowser, IID_IShellBrowser, (void**)&browser);
-                                            if (SUCCEEDED(hr) && browser) {
-                                                CComPtr<IShellView> view;
-                                                hr = browser->QueryActiveShellView(&view);
-                                                if (SUCCEEDED(hr) && view) {
-                                                    CComPtr<IFolderView> folderView;
-                                                    hr = view->QueryInterface(IID_IFolderView, (void**)&folderView);
-                                                    if (SUCCEEDED(hr) && folderView) {
-                                                        CComPtr<IPersistFolder2> folder;
-                                                        hr = folderView->GetFolder(IID_IPersistFolder2, (void**)&folder);
-                                                        if (SUCCEEDED(hr) && folder) {
-                                                            LPITEMIDLIST pidl;
-                                                            hr = folder->GetCurFolder(&pidl);
-                                                            if (SUCCEEDED(hr) && pidl) {
-                                                                wchar_t pathBuffer[MAX_PATH];
-                                                                SHGetPathFromIDList(pidl, pathBuffer);
-                                                                path = pathBuffer;
-                                                                CoTaskMemFree(pidl);
-                                                                if (_wcsicmp(path.c_str(), params->targetPath->c_str()) == 0) {
-                                                                    *(params->result) = hwnd;
-                                                                    return FALSE;
-                                                                }
-                                                            }
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-                return TRUE;
-                }, (LPARAM)&findParams);
-
-            if (newHwnd) {
-                openedPaths[window.path] = newHwnd;
-                ShowWindow(newHwnd, SW_NORMAL);
-                Sleep(200);
-                MoveWindow(
-                    newHwnd,
-                    window.position.left,
-                    window.position.top,
-                    window.position.right - window.position.left,
-                    window.position.bottom - window.position.top,
-                    TRUE
-                );
-                if (window.placement.showCmd == SW_MAXIMIZE) {
-                    ShowWindow(newHwnd, SW_MAXIMIZE);
-                }
-                else if (window.placement.showCmd == SW_MINIMIZE) {
-                    ShowWindow(newHwnd, SW_MINIMIZE);
-                }
-                HWND insertAfter = HWND_TOP;
-                if (window.placement.showCmd == SW_MINIMIZE) {
-                    insertAfter = HWND_BOTTOM;
-                }
-                SetWindowPos(newHwnd, insertAfter, 0, 0, 0, 0,
-                    SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
-            }
-        }
-    }
+    DestroyTrayIconCache();
+    g_trayIcons.autohide = base;
+    g_trayIcons.visible = visible;
+    g_trayIcons.dpi = dpi;
+    return true;
 }
 
-/*
- * Tray Icon Tooltip Update:
- * Updates system tray tooltip to reflect current taskbar state
- */
-void UpdateTrayIconTooltip() {
-    BYTE currentSetting = GetCurrentTaskbarSetting();
-    g_nid.uFlags = NIF_TIP;
+void DestroyTrayIconCache() {
+    if (g_trayIcons.autohide) DestroyIcon(g_trayIcons.autohide);
+    if (g_trayIcons.visible) DestroyIcon(g_trayIcons.visible);
+    ZeroMemory(&g_trayIcons, sizeof(g_trayIcons));
+}
 
-    if (currentSetting == TASKBAR_AUTOHIDE) {
+// Fills the icon and tooltip of g_nid for the current taskbar state.
+void ApplyTrayIconState() {
+    bool autohide = GetCurrentTaskbarSetting() == TASKBAR_AUTOHIDE;
+    g_nid.hIcon = autohide ? g_trayIcons.autohide : g_trayIcons.visible;
+    if (autohide) {
         wcscpy_s(g_nid.szTip, L"Show the taskbar automatically");
     }
     else {
         wcscpy_s(g_nid.szTip, L"Hide the taskbar automatically");
     }
+}
 
+/*
+ * Tray Icon Update:
+ * Swaps the cached icon and the tooltip to reflect the current taskbar
+ * state. No resources are loaded here.
+ */
+void UpdateTrayIcon() {
+    g_nid.uFlags = NIF_ICON | NIF_TIP;
+    ApplyTrayIconState();
     Shell_NotifyIcon(NIM_MODIFY, &g_nid);
 }
 
+// DPI of the tray window, or of the screen when it has none or the API is missing.
+UINT GetTrayIconDpi(HWND hwnd) {
+    static GetDpiForWindowProc getDpiForWindow = (GetDpiForWindowProc)GetProcAddress(
+        GetModuleHandleW(L"user32.dll"), "GetDpiForWindow");
+    UINT dpi = getDpiForWindow ? getDpiForWindow(hwnd) : 0;
+    if (dpi) return dpi;
+
+    HDC screen = GetDC(NULL);
+    dpi = screen ? (UINT)GetDeviceCaps(screen, LOGPIXELSX) : 96;
+    if (screen) ReleaseDC(NULL, screen);
+    return dpi;
+}
+
+// Rebuilds the cache and refreshes the icon only when the DPI moved.
+void ReloadTrayIconCache(HWND hwnd) {
+    UINT dpi = GetTrayIconDpi(hwnd);
+    if (dpi != g_trayIcons.dpi && BuildTrayIconCache(dpi)) {
+        UpdateTrayIcon();
+    }
+}
+
 void SetupTrayIcon(HWND hwnd) {
-    ZeroMemory(&g_nid, sizeof(g_nid));
+    UINT dpi = GetTrayIconDpi(hwnd);
+    if (!g_trayIcons.autohide || dpi != g_trayIcons.dpi) BuildTrayIconCache(dpi);
 
+    ZeroMemory(&g_nid, sizeof(g_nid));
     g_nid.cbSize = sizeof(NOTIFYICONDATA);
     g_nid.hWnd = hwnd;
     g_nid.uID = 1;
     g_nid.uFlags = NIF_ICON | NIF_MESSAGE | NIF_TIP;
     g_nid.uCallbackMessage = WM_TRAYICON;
-
-    // Load the icon from resources using IDI_ICON2
-    g_nid.hIcon = LoadIconW(GetModuleHandleW(NULL), MAKEINTRESOURCEW(IDI_ICON2));
-
-    if (!g_nid.hIcon) {
-        // Fallback to system icon if resource loading fails
-        g_nid.hIcon = LoadIconW(NULL, IDI_APPLICATION);
-    }
-
-    BYTE currentSetting = GetCurrentTaskbarSetting();
-    if (currentSetting == TASKBAR_AUTOHIDE) {
-        wcscpy_s(g_nid.szTip, L"Show the taskbar automatically");
-    }
-    else {
-        wcscpy_s(g_nid.szTip, L"Hide the taskbar automatically");
-    }
+    ApplyTrayIconState();
 
     Shell_NotifyIconW(NIM_ADD, &g_nid);
 }
 
+// The icons belong to g_trayIcons and outlive the notification icon.
 void RemoveTrayIcon() {
     if (g_nid.cbSize > 0) {
         Shell_NotifyIcon(NIM_DELETE, &g_nid);
-        if (g_nid.hIcon) {
-            DestroyIcon(g_nid.hIcon);
-            g_nid.hIcon = NULL;
-        }
+        g_nid.hIcon = NULL;
     }
 }
 
@@ -752,25 +3696,75 @@ void RemoveTrayIcon() {
 LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
     if (message == WM_TASKBARCREATED && g_trayMode) {
         SetupTrayIcon(hwnd);
+        // The old IShellWindows died with the previous shell.
+        StartExplorerIndex();
         return 0;
     }
 
     switch (message) {
+    case WM_DPICHANGED:
+        if (g_trayMode && HIWORD(wParam) != g_trayIcons.dpi && BuildTrayIconCache(HIWORD(wParam))) {
+            UpdateTrayIcon();
+        }
+        return 0;
+
+    case WM_DISPLAYCHANGE:
+    case WM_SETTINGCHANGE:
+        if (g_trayMode) ReloadTrayIconCache(hwnd);
+        break;
+
+    case WM_SHELLSTARTING:
+        StopExplorerIndex();
+        BeginShellWatch((HANDLE)lParam);
+        return 0;
+
+    case WM_EXPLORERINDEXCHANGED:
+        RefreshExplorerIndex((HWND)wParam);
+        return 0;
+
+    case WM_SHELLEXITED:
+        // The shell died before its taskbar appeared; the watchdog will
+        // start another one and post a new WM_SHELLSTARTING.
+        if ((ULONG_PTR)wParam == g_shellWatchGeneration) EndShellWatch();
+        return 0;
+
     case WM_TIMER:
-        if (wParam == 1234) {
-            KillTimer(hwnd, 1234);
-            if (g_trayMode) {
-                RemoveTrayIcon();
-                SetupTrayIcon(hwnd);
-                g_isRestartingExplorer = false;
-            }
+        if (wParam == RULE_TIMER_ID) {
+            ApplyToggleRules();
             return 0;
         }
         break;
 
+    case WM_TASKBARSTATECHANGED:
+        if (g_trayMode) UpdateTrayIcon();
+        return 0;
+
+    case WM_TOGGLEPROGRESS:
+        if (wParam == TOGGLE_PROGRESS_STARTED) {
+            g_nid.uFlags = NIF_TIP;
+            wcscpy_s(g_nid.szTip, L"Toggling the taskbar...");
+            Shell_NotifyIcon(NIM_MODIFY, &g_nid);
+        }
+        else {
+            UpdateTrayIcon();
+        }
+        return 0;
+
+    case WM_COPYDATA: {
+        // Command forwarded by a second launch (see ForwardToResidentInstance)
+        const COPYDATASTRUCT* copyData = (const COPYDATASTRUCT*)lParam;
+        const ForwardedCommand* command = (const ForwardedCommand*)copyData->lpData;
+        if (copyData->dwData != COPYDATA_TOGGLE_COMMAND || copyData->cbData != sizeof(ForwardedCommand) ||
+            command->size != sizeof(ForwardedCommand) || !g_toggleWorker) {
+            return FALSE;
+        }
+        QueueToggleRequest(command->options);
+        return TRUE;
+    }
+
     case WM_TRAYICON:
         if (lParam == WM_LBUTTONUP) {
-            ExecuteToggleAction();
+            QueueToggleRequest(g_commandLineOptions);
             return 0;
         }
         else if (lParam == WM_RBUTTONUP) {
@@ -778,6 +3772,16 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
             GetCursorPos(&pt);
             HMENU hMenu = CreatePopupMenu();
             if (hMenu) {
+                InsertStatisticsMenu(hMenu);
+                InsertMenu(hMenu, -1, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
+                AcquireSRWLockShared(&g_heldExplorerLock);
+                size_t heldCount = g_heldExplorerWindows.size();
+                ReleaseSRWLockShared(&g_heldExplorerLock);
+                if (heldCount > 0) {
+                    wchar_t reopenText[64];
+                    StringCchPrintfW(reopenText, ARRAYSIZE(reopenText), L"&Reopen minimized folders (%Iu)", heldCount);
+                    InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_TRAY_REOPEN_HELD, reopenText);
+                }
                 InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_TRAY_EXIT, L"&Quit application");
                 SetForegroundWindow(hwnd);
                 TrackPopupMenu(hMenu, TPM_BOTTOMALIGN | TPM_LEFTALIGN,
@@ -794,6 +3798,11 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
             PostQuitMessage(0);
             return 0;
         }
+        if (LOWORD(wParam) == ID_TRAY_REOPEN_HELD && g_toggleRequestEvent) {
+            InterlockedExchange(&g_reopenHeldRequested, 1);
+            SetEvent(g_toggleRequestEvent);
+            return 0;
+        }
         break;
 
     case WM_DESTROY:
@@ -1,3 +1,293 @@
 #pragma once
 
 #include "resource.h"
+#include <ShlObj.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <functional>
+
+/*
+ * Declarations shared between the application and the benchmark target
+ * (ToggleTaskbarAutohideBenchmark.vcxproj), which compiles the same
+ * ToggleTaskbarAutohide.cpp with TOGGLE_BENCHMARK defined.
+ */
+
+/*
+ * Owning, copyable absolute ITEMIDLIST. Folder locations are kept as PIDLs
+ * rather than file system paths, so virtual folders (This PC, Libraries,
+ * Network, search results) and paths longer than MAX_PATH survive a
+ * capture and restore unchanged.
+ */
+class FolderId {
+public:
+    FolderId() : m_pidl(NULL) {}
+    FolderId(const FolderId& other) : m_pidl(other.m_pidl ? ILCloneFull(other.m_pidl) : NULL) {}
+    FolderId(FolderId&& other) noexcept : m_pidl(other.m_pidl) { other.m_pidl = NULL; }
+    ~FolderId() { ILFree(m_pidl); }
+
+    // Copy and move assignment; a copy is made at the call site, so the
+    // swap itself cannot throw.
+    FolderId& operator=(FolderId other) noexcept {
+        PIDLIST_ABSOLUTE pidl = m_pidl;
+        m_pidl = other.m_pidl;
+        other.m_pidl = pidl;
+        return *this;
+    }
+
+    // Takes ownership of a PIDL allocated by the shell (CoTaskMemAlloc).
+    void Attach(PIDLIST_ABSOLUTE pidl) {
+        ILFree(m_pidl);
+        m_pidl = pidl;
+    }
+
+    PCIDLIST_ABSOLUTE Get() const { return m_pidl; }
+    bool Empty() const { return m_pidl == NULL; }
+    bool Equals(const FolderId& other) const {
+        return m_pidl && other.m_pidl && ILIsEqual(m_pidl, other.m_pidl);
+    }
+
+private:
+    PIDLIST_ABSOLUTE m_pidl;
+};
+
+/*
+ * Captured state of one Explorer folder window
+ */
+struct ExplorerWindow {
+    FolderId folder;
+    RECT position;
+    WINDOWPLACEMENT placement;
+    HWND hwnd;
+    HWND focusedHwnd;
+    DWORD zOrder;
+};
+
+// Every shell folder window, mapped to the folder it shows
+typedef std::map<HWND, FolderId> ExplorerFolderIndex;
+
+/*
+ * Identity of a top-level window that survives its HWND: owning process,
+ * window class and title, the latter two as FNV-1a hashes.
+ */
+struct DesktopWindowKey {
+    DWORD processId;
+    DWORD classHash;
+    DWORD titleHash;
+
+    bool operator==(const DesktopWindowKey& other) const {
+        return processId == other.processId && classHash == other.classHash && titleHash == other.titleHash;
+    }
+};
+
+struct DesktopWindowRecord {
+    HWND hwnd;
+    DesktopWindowKey key;
+};
+
+struct ForegroundAppInfo {
+    HWND hwnd;
+    DesktopWindowKey key;
+    WINDOWPLACEMENT placement;
+};
+
+/*
+ * Stacking order of the user's top-level windows, top-most first, plus the
+ * window that had focus. Captured once before the restart.
+ */
+struct DesktopSnapshot {
+    ForegroundAppInfo foreground;
+    std::vector<DesktopWindowRecord> windows;
+};
+
+// Folder windows re-created by RestoreExplorerWindows(): old HWND -> new HWND
+typedef std::unordered_map<HWND, HWND> WindowRemap;
+
+/*
+ * Desktop Backend:
+ * Every window manager and shell call made by the capture and restore code
+ * (GetOpenExplorerWindows, RestoreExplorerWindows, CaptureDesktopSnapshot,
+ * RestoreDesktopSnapshot and the deferred restore). The application always runs on the real
+ * desktop; the benchmark installs a synthetic one with SetDesktopBackend()
+ * to measure how those functions scale with the number of windows.
+ */
+class DesktopBackend {
+public:
+    virtual ~DesktopBackend() {}
+
+    // Top-level windows, top-most first
+    virtual HWND FirstWindow() = 0;
+    virtual HWND NextWindow(HWND hwnd) = 0;
+    virtual bool IsAlive(HWND hwnd) = 0;
+    virtual bool IsVisible(HWND hwnd) = 0;
+    virtual LONG_PTR ExStyle(HWND hwnd) = 0;
+    virtual DWORD ProcessOf(HWND hwnd) = 0;
+    virtual int ClassOf(HWND hwnd, wchar_t* text, int length) = 0;
+    // Atom of the window's class; equal atoms mean equal class names
+    virtual ATOM ClassAtom(HWND hwnd) = 0;
+    virtual int TitleOf(HWND hwnd, wchar_t* text, int length) = 0;
+    virtual bool ReadPlacement(HWND hwnd, WINDOWPLACEMENT* placement) = 0;
+    virtual bool WritePlacement(HWND hwnd, const WINDOWPLACEMENT* placement) = 0;
+    virtual HWND Foreground() = 0;
+    // The focused window if it is a child of top, else NULL
+    virtual HWND FocusedChild(HWND top) = 0;
+    // Stacks the non-NULL windows in this order, top-most first
+    virtual void ApplyZOrder(const HWND* topFirst, size_t count) = 0;
+    // Moves windows[i] directly below above[i] (HWND_TOP: to the top), in order
+    virtual void InsertBelow(const HWND* windows, const HWND* above, size_t count) = 0;
+    // As MonitorFromWindow
+    virtual HMONITOR MonitorOf(HWND hwnd, DWORD flags) = 0;
+    // Shows the window with showCmd and gives it the foreground
+    virtual void Activate(HWND hwnd, int showCmd) = 0;
+
+    // Shell folder windows. skip (sorted, may be NULL) lists HWNDs the
+    // caller has already matched, whose folders need not be resolved again.
+    virtual void ListFolderWindows(const HWND* skip, size_t skipCount, ExplorerFolderIndex& index) = 0;
+    // showCmd is the window's first show; it decides whether it is activated.
+    virtual bool OpenFolder(const FolderId& folder, int showCmd) = 0;
+    // Between Begin and End, WaitForFolderWindows re-runs scan whenever the
+    // set of folder windows may have changed, until it returns true or the
+    // timeout elapses.
+    virtual bool BeginFolderWatch() = 0;
+    virtual bool WaitForFolderWindows(const std::function<bool()>& scan, DWORD timeoutMs) = 0;
+    virtual void EndFolderWatch() = 0;
+};
+
+// NULL goes back to the real desktop.
+void SetDesktopBackend(DesktopBackend* backend);
+
+/*
+ * Toggle Stages:
+ * Each phase of ExecuteToggleAction() is timed with QueryPerformanceCounter
+ * and reported as a start/stop pair by the TraceLogging provider.
+ */
+enum ToggleStage {
+    STAGE_TOGGLE,
+    STAGE_LIVE_TOGGLE,
+    STAGE_SNAPSHOT_FOREGROUND,
+    STAGE_SNAPSHOT_EXPLORER,
+    STAGE_REGISTRY_WRITE,
+    STAGE_SETTING_BROADCAST,
+    STAGE_KILL_EXPLORER,
+    STAGE_START_EXPLORER,
+    STAGE_VERIFY,
+    STAGE_RESTORE_WINDOWS,
+    STAGE_RESTORE_FOCUS,
+    STAGE_RESTORE_DEFERRED,
+    STAGE_COUNT
+};
+
+extern const char* const g_stageNames[STAGE_COUNT];
+
+struct ToggleMetrics {
+    double stageMs[STAGE_COUNT];
+    bool stageRan[STAGE_COUNT];
+    DWORD windowsCaptured;
+    DWORD windowsRestored;
+    DWORD windowsDeferred;
+    DWORD restoreFailures;
+    bool restartedExplorer;
+    // The restarted shell came up with the new setting, before any live fix
+    bool settingVerified;
+    bool rolledBack;
+    bool succeeded;
+};
+
+extern ToggleMetrics g_lastToggleMetrics;
+
+/*
+ * Toggle Statistics:
+ * Running totals kept by the resident instance, shown in the tray menu and
+ * published as a ToggleStatistics in the shared memory block
+ * TOGGLE_STATS_MAPPING_NAME for monitoring tools. sequence is odd while the
+ * block is being written: a reader copies the block and keeps the copy only
+ * if sequence was even and unchanged across the copy. Percentiles are
+ * nearest-rank over the last TOGGLE_STATS_HISTORY toggles that ran the stage.
+ */
+#define TOGGLE_STATS_MAPPING_NAME L"Local\\ToggleTaskbarAutohide.Stats"
+#define TOGGLE_STATS_MAGIC 0x53415454 // 'TTAS'
+#define TOGGLE_STATS_VERSION 1
+#define TOGGLE_STATS_HISTORY 64
+
+struct ToggleStageStatistics {
+    DWORD samples;
+    double lastMs;
+    double p50Ms;
+    double p95Ms;
+    double p99Ms;
+};
+
+struct ToggleStatistics {
+    DWORD magic;
+    DWORD version;
+    DWORD size;
+    volatile LONG sequence;
+    DWORD processId;
+    ULONGLONG lastToggleTime;   // FILETIME, UTC
+    ULONGLONG toggles;
+    ULONGLONG failedToggles;
+    ULONGLONG explorerRestarts;
+    ULONGLONG explorerRestartFailures;
+    ULONGLONG rollbacks;
+    ULONGLONG windowsCaptured;
+    ULONGLONG windowsRestored;
+    ULONGLONG windowsLost;
+    ULONGLONG workingSetBytes;
+    ULONGLONG privateBytes;
+    ToggleStageStatistics stages[STAGE_COUNT];  // indexed by ToggleStage
+};
+
+// Consistent copy of this process's statistics
+void GetToggleStatistics(ToggleStatistics& statistics);
+
+/*
+ * Which toggle path ExecuteToggleAction() may take. AUTO tries the live
+ * AppBar path first and falls back to the registry + Explorer restart.
+ */
+enum ToggleMethod {
+    TOGGLE_METHOD_AUTO,
+    TOGGLE_METHOD_LIVE,
+    TOGGLE_METHOD_RESTART
+};
+
+/*
+ * State a request asks for: FLIP inverts the current state (a plain
+ * launch or a tray click), the others set it (--enable / --disable) and
+ * are a no-op when the taskbar is already there.
+ */
+enum ToggleTarget {
+    TOGGLE_TARGET_FLIP,
+    TOGGLE_TARGET_AUTOHIDE,
+    TOGGLE_TARGET_ALWAYS_VISIBLE
+};
+
+/*
+ * Per-request options. Parsed once from the command line, and forwarded
+ * verbatim to the resident tray instance over WM_COPYDATA.
+ */
+struct ToggleOptions {
+    ToggleTarget target;
+    bool noReopenExplorer;
+    bool restartExplorer;
+    bool separateProcess;
+    // --holdminimized: minimized folder windows wait for the tray menu
+    bool holdMinimized;
+    // --monitor=<name>: "primary" or an MMStuckRects3 value name; empty = all
+    wchar_t monitor[64];
+};
+
+bool InitToggleRuntime(bool resident);
+void ShutdownToggleRuntime();
+// options == NULL uses the options of this process's command line.
+void ExecuteToggleAction(ToggleMethod method = TOGGLE_METHOD_AUTO, const ToggleOptions* options = NULL);
+std::vector<ExplorerWindow> GetOpenExplorerWindows();
+// activate = false opens the windows without taking the foreground.
+size_t RestoreExplorerWindows(const std::vector<ExplorerWindow>& windows, WindowRemap& remap, bool activate = true);
+DesktopSnapshot CaptureDesktopSnapshot();
+void RestoreDesktopSnapshot(const DesktopSnapshot& snapshot, const WindowRemap& remap);
+void SplitDeferredExplorerWindows(std::vector<ExplorerWindow>& windows, HWND foreground,
+    std::vector<ExplorerWindow>& deferred);
+size_t RestoreDeferredExplorerWindows(const std::vector<ExplorerWindow>& windows,
+    const DesktopSnapshot& snapshot, WindowRemap& remap);
@@ -0,0 +1,169 @@
+﻿/*
+╔═══════════════════════════════════════════════════════════════════════════════╗
+║ ToggleTaskbarAutohideBenchmark.cpp                                            ║
+╠═══════════════════════════════════════════════════════════════════════════════╣
+║ Purpose: Run the toggle pipeline back to back and report latency percentiles. ║
+║                                                                               ║
+╚═══════════════════════════════════════════════════════════════════════════════╝
+*/
+
+/*
+=======================[ BENCHMARK OVERVIEW ]======================
+Runs ExecuteToggleAction() N times per toggle method on the current desktop
+and reports p50/p95/p99 latency for the whole toggle and every stage. For
+iterations that restarted Explorer it also reports how many folder windows
+came back with the right folder and placement, and how often the restarted
+shell read the new setting from the registry without a live correction.
+
+Usage:
+  ToggleTaskbarAutohideBenchmark.exe [--iterations N] [--method auto|live|restart|all]
+  ToggleTaskbarAutohideBenchmark.exe --synthetic [--iterations N]
+
+The iteration count is rounded up to an even number so the taskbar ends in
+the state it started in. "all" (the default) runs every method in turn so
+they can be compared on the same machine. --synthetic leaves the desktop
+alone and measures capture and restore on in-memory desktops instead (see
+ToggleTaskbarAutohideSyntheticDesktop.cpp).
+*/
+#include "framework.h"
+#include "ToggleTaskbarAutohide.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+int RunSyntheticBenchmark(int iterations);
+
+struct MethodResult {
+    const wchar_t* name;
+    std::vector<double> stageSamples[STAGE_COUNT];
+    DWORD windowsExpected;
+    DWORD windowsCorrect;
+    int failures;
+    int restarts;
+    int settingVerified;
+};
+
+/*
+ * Nearest-rank percentile of the given samples (p in 0..100).
+ */
+double Percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * samples.size());
+    if (rank == 0) rank = 1;
+    return samples[min(rank, samples.size()) - 1];
+}
+
+bool PlacementMatches(const WINDOWPLACEMENT& expected, const WINDOWPLACEMENT& actual) {
+    return expected.showCmd == actual.showCmd &&
+        EqualRect(&expected.rcNormalPosition, &actual.rcNormalPosition);
+}
+
+/*
+ * Counts snapshot entries that have a window with the same folder and
+ * placement after the toggle. Each restored window is matched only once.
+ */
+DWORD CountCorrectlyRestored(const std::vector<ExplorerWindow>& before,
+    const std::vector<ExplorerWindow>& after) {
+    std::vector<bool> used(after.size(), false);
+    DWORD correct = 0;
+    for (const auto& expected : before) {
+        for (size_t i = 0; i < after.size(); i++) {
+            if (used[i] || !expected.folder.Equals(after[i].folder)) continue;
+            if (!PlacementMatches(expected.placement, after[i].placement)) continue;
+            used[i] = true;
+            correct++;
+            break;
+        }
+    }
+    return correct;
+}
+
+void RunMethod(ToggleMethod method, int iterations, MethodResult& result) {
+    for (int i = 0; i < iterations; i++) {
+        std::vector<ExplorerWindow> before = GetOpenExplorerWindows();
+        ExecuteToggleAction(method);
+        ToggleMetrics metrics = g_lastToggleMetrics;
+
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            if (metrics.stageRan[stage]) result.stageSamples[stage].push_back(metrics.stageMs[stage]);
+        }
+        if (!metrics.succeeded) result.failures++;
+        if (metrics.restartedExplorer) {
+            result.restarts++;
+            if (metrics.settingVerified) result.settingVerified++;
+            std::vector<ExplorerWindow> after = GetOpenExplorerWindows();
+            result.windowsExpected += (DWORD)before.size();
+            result.windowsCorrect += CountCorrectlyRestored(before, after);
+        }
+        wprintf(L"  %s %d/%d: %.1f ms%s\n", result.name, i + 1, iterations,
+            metrics.stageMs[STAGE_TOGGLE], metrics.succeeded ? L"" : L" (failed)");
+    }
+}
+
+void PrintReport(const MethodResult& result, int iterations) {
+    wprintf(L"\n=== %s (%d iterations, %d restarts, %d failures) ===\n",
+        result.name, iterations, result.restarts, result.failures);
+    wprintf(L"%-20s %6s %10s %10s %10s\n", L"Stage", L"n", L"p50 ms", L"p95 ms", L"p99 ms");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const std::vector<double>& samples = result.stageSamples[stage];
+        if (samples.empty()) continue;
+        wprintf(L"%-20S %6u %10.2f %10.2f %10.2f\n", g_stageNames[stage], (unsigned)samples.size(),
+            Percentile(samples, 50), Percentile(samples, 95), Percentile(samples, 99));
+    }
+    if (result.restarts > 0) {
+        wprintf(L"Restarted shell read the new setting: %d/%d\n", result.settingVerified, result.restarts);
+    }
+    if (result.windowsExpected > 0) {
+        wprintf(L"Windows restored to the right path and placement: %u/%u (%.1f%%)\n",
+            result.windowsCorrect, result.windowsExpected,
+            100.0 * result.windowsCorrect / result.windowsExpected);
+    }
+}
+
+int wmain(int argc, wchar_t** argv) {
+    int iterations = 20;
+    const wchar_t* methodName = L"all";
+    bool synthetic = false;
+    for (int i = 1; i < argc; i++) {
+        if (_wcsicmp(argv[i], L"--iterations") == 0 && i + 1 < argc) iterations = _wtoi(argv[++i]);
+        else if (_wcsicmp(argv[i], L"--method") == 0 && i + 1 < argc) methodName = argv[++i];
+        else if (_wcsicmp(argv[i], L"--synthetic") == 0) synthetic = true;
+    }
+    if (iterations < 2) iterations = 2;
+    if (iterations % 2 != 0) iterations++;
+
+    struct { const wchar_t* name; ToggleMethod method; } methods[] = {
+        { L"live", TOGGLE_METHOD_LIVE },
+        { L"restart", TOGGLE_METHOD_RESTART },
+        { L"auto", TOGGLE_METHOD_AUTO }
+    };
+
+    if (!InitToggleRuntime(false)) {
+        fwprintf(stderr, L"COM initialization failed\n");
+        return 1;
+    }
+
+    if (synthetic) {
+        int status = RunSyntheticBenchmark(iterations);
+        ShutdownToggleRuntime();
+        return status;
+    }
+
+    std::vector<MethodResult> results;
+    for (const auto& entry : methods) {
+        bool runAll = _wcsicmp(methodName, L"all") == 0;
+        if (!runAll && _wcsicmp(methodName, entry.name) != 0) continue;
+        if (runAll && entry.method == TOGGLE_METHOD_AUTO) continue;
+
+        MethodResult result = {};
+        result.name = entry.name;
+        wprintf(L"Running %s x%d\n", entry.name, iterations);
+        RunMethod(entry.method, iterations, result);
+        results.push_back(result);
+    }
+
+    for (const auto& result : results) PrintReport(result, iterations);
+    ShutdownToggleRuntime();
+    return results.empty() ? 2 : 0;
+}
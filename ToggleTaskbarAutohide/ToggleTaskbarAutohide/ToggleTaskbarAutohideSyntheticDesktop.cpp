@@ -0,0 +1,429 @@
+﻿/*
+╔═══════════════════════════════════════════════════════════════════════════════╗
+║ ToggleTaskbarAutohideSyntheticDesktop.cpp                                     ║
+╠═══════════════════════════════════════════════════════════════════════════════╣
+║ Purpose: Measure how capture and restore scale on synthetic desktops.         ║
+║                                                                               ║
+╚═══════════════════════════════════════════════════════════════════════════════╝
+*/
+
+/*
+=====================[ SYNTHETIC DESKTOP OVERVIEW ]=====================
+SyntheticDesktop implements DesktopBackend over an in-memory window list, so
+GetOpenExplorerWindows(), CaptureDesktopSnapshot(), RestoreExplorerWindows(),
+RestoreDesktopSnapshot() and the deferred restore run unchanged without
+touching the real desktop or the shell. Every backend call is counted.
+
+RunSyntheticBenchmark() builds desktops of 10, 100 and 500 ordinary
+top-level windows with 1, 10 and 100 folder windows on top, a quarter of
+them minimized and a quarter on a second monitor. It captures them, drops
+the folder windows as an Explorer restart would, and restores them, the
+minimized and off-monitor ones through the deferred pass.
+For each size and phase it prints the backend calls, the folder entries
+listed, the time and the operator new allocations per iteration. Costs that
+grow with the square of the window count show up as a jump between rows.
+*/
+#include "framework.h"
+#include "ToggleTaskbarAutohide.h"
+#include <algorithm>
+#include <cstdio>
+#include <new>
+
+/*
+ * Allocation counting:
+ * operator new is replaced for the whole benchmark executable; allocations
+ * are only counted while g_countAllocations is set. Requests that overflow
+ * the toggle arena fall back to operator new and are counted; shell
+ * allocations (CoTaskMemAlloc, used for PIDLs) are not included.
+ */
+bool g_countAllocations = false;
+DWORD64 g_allocationCount = 0;
+
+void* operator new(size_t size) {
+    if (g_countAllocations) g_allocationCount++;
+    void* block = malloc(size ? size : 1);
+    if (!block) throw std::bad_alloc();
+    return block;
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+
+// Bookkeeping of the synthetic desktop itself is not the code under test.
+struct UncountedScope {
+    bool saved;
+    UncountedScope() : saved(g_countAllocations) { g_countAllocations = false; }
+    ~UncountedScope() { g_countAllocations = saved; }
+};
+
+#define SYNTHETIC_SHELL_PID 4
+#define SYNTHETIC_FOLDER_CLASS L"CabinetWClass"
+#define SYNTHETIC_APP_CLASS L"SyntheticAppWindow"
+#define SYNTHETIC_FOLDER_ATOM 0xC001
+#define SYNTHETIC_APP_ATOM 0xC002
+#define SYNTHETIC_PRIMARY_MONITOR ((HMONITOR)(ULONG_PTR)0x10)
+#define SYNTHETIC_SECONDARY_MONITOR ((HMONITOR)(ULONG_PTR)0x20)
+
+struct SyntheticWindow {
+    DWORD processId;
+    const wchar_t* className;
+    ATOM classAtom;
+    std::wstring title;
+    LONG_PTR exStyle;
+    WINDOWPLACEMENT placement;
+    HMONITOR monitor;
+    FolderId folder;
+};
+
+class SyntheticDesktop : public DesktopBackend {
+public:
+    SyntheticDesktop() : m_nextHwnd(0x10000), m_foreground(NULL), m_calls(0), m_listed(0) {}
+
+    /*
+     * Top-level windows are added below the existing ones; folder windows
+     * are registered with the synthetic shell right away.
+     */
+    HWND AddWindow(DWORD processId, const wchar_t* className, const std::wstring& title, const FolderId* folder) {
+        HWND hwnd = (HWND)(ULONG_PTR)(m_nextHwnd += 4);
+        SyntheticWindow& window = m_windows[hwnd];
+        window.processId = processId;
+        window.className = className;
+        window.classAtom = wcscmp(className, SYNTHETIC_FOLDER_CLASS) == 0 ? SYNTHETIC_FOLDER_ATOM : SYNTHETIC_APP_ATOM;
+        window.title = title;
+        window.exStyle = 0;
+        window.placement = {};
+        window.placement.length = sizeof(WINDOWPLACEMENT);
+        window.placement.showCmd = SW_SHOWNORMAL;
+        SetRect(&window.placement.rcNormalPosition, 0, 0, 800, 600);
+        window.monitor = SYNTHETIC_PRIMARY_MONITOR;
+        if (folder) {
+            window.folder = *folder;
+            m_folderWindows.push_back(hwnd);
+        }
+        m_position[hwnd] = m_order.size();
+        m_order.push_back(hwnd);
+        return hwnd;
+    }
+
+    void SetForeground(HWND hwnd) { m_foreground = hwnd; }
+    void SetShowCmd(HWND hwnd, UINT showCmd) { m_windows.at(hwnd).placement.showCmd = showCmd; }
+    void SetMonitor(HWND hwnd, HMONITOR monitor) { m_windows.at(hwnd).monitor = monitor; }
+
+    // What a shell restart leaves behind: every folder window is gone.
+    void DropFolderWindows() {
+        for (HWND hwnd : m_folderWindows) m_windows.erase(hwnd);
+        m_folderWindows.clear();
+        std::vector<HWND> order;
+        for (HWND hwnd : m_order) {
+            if (m_windows.count(hwnd)) order.push_back(hwnd);
+        }
+        SetOrder(order);
+        if (!m_windows.count(m_foreground)) m_foreground = NULL;
+    }
+
+    void ResetCounters() {
+        m_calls = 0;
+        m_listed = 0;
+    }
+    DWORD64 Calls() const { return m_calls; }
+    DWORD64 Listed() const { return m_listed; }
+
+    HWND FirstWindow() {
+        m_calls++;
+        return m_order.empty() ? NULL : m_order.front();
+    }
+    HWND NextWindow(HWND hwnd) {
+        m_calls++;
+        auto position = m_position.find(hwnd);
+        if (position == m_position.end() || position->second + 1 >= m_order.size()) return NULL;
+        return m_order[position->second + 1];
+    }
+    bool IsAlive(HWND hwnd) {
+        m_calls++;
+        return m_windows.count(hwnd) != 0;
+    }
+    bool IsVisible(HWND hwnd) {
+        m_calls++;
+        return m_windows.count(hwnd) != 0;
+    }
+    LONG_PTR ExStyle(HWND hwnd) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        return window ? window->exStyle : 0;
+    }
+    DWORD ProcessOf(HWND hwnd) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        return window ? window->processId : 0;
+    }
+    int ClassOf(HWND hwnd, wchar_t* text, int length) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        return CopyText(window ? window->className : L"", text, length);
+    }
+    ATOM ClassAtom(HWND hwnd) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        return window ? window->classAtom : 0;
+    }
+    int TitleOf(HWND hwnd, wchar_t* text, int length) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        return CopyText(window ? window->title.c_str() : L"", text, length);
+    }
+    bool ReadPlacement(HWND hwnd, WINDOWPLACEMENT* placement) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        if (!window) return false;
+        *placement = window->placement;
+        return true;
+    }
+    bool WritePlacement(HWND hwnd, const WINDOWPLACEMENT* placement) {
+        m_calls++;
+        auto window = m_windows.find(hwnd);
+        if (window == m_windows.end()) return false;
+        window->second.placement = *placement;
+        return true;
+    }
+    HWND Foreground() {
+        m_calls++;
+        return m_foreground;
+    }
+    HWND FocusedChild(HWND) {
+        m_calls++;
+        return NULL;
+    }
+    void ApplyZOrder(const HWND* topFirst, size_t count) {
+        m_calls++;
+        UncountedScope uncounted;
+        std::vector<HWND> order;
+        std::set<HWND> placed;
+        for (size_t i = 0; i < count; i++) {
+            HWND hwnd = topFirst[i];
+            if (hwnd && m_windows.count(hwnd) && placed.insert(hwnd).second) order.push_back(hwnd);
+        }
+        for (HWND hwnd : m_order) {
+            if (!placed.count(hwnd)) order.push_back(hwnd);
+        }
+        SetOrder(order);
+    }
+    void InsertBelow(const HWND* windows, const HWND* above, size_t count) {
+        m_calls++;
+        UncountedScope uncounted;
+        for (size_t i = 0; i < count; i++) {
+            if (!m_windows.count(windows[i]) || (above[i] != HWND_TOP && !m_windows.count(above[i]))) continue;
+            std::vector<HWND> order;
+            if (above[i] == HWND_TOP) order.push_back(windows[i]);
+            for (HWND hwnd : m_order) {
+                if (hwnd == windows[i]) continue;
+                order.push_back(hwnd);
+                if (hwnd == above[i]) order.push_back(windows[i]);
+            }
+            SetOrder(order);
+        }
+    }
+    HMONITOR MonitorOf(HWND hwnd, DWORD flags) {
+        m_calls++;
+        const SyntheticWindow* window = Find(hwnd);
+        if (window) return window->monitor;
+        return flags == MONITOR_DEFAULTTONULL ? NULL : SYNTHETIC_PRIMARY_MONITOR;
+    }
+    void Activate(HWND hwnd, int showCmd) {
+        m_calls++;
+        auto window = m_windows.find(hwnd);
+        if (window == m_windows.end()) return;
+        if (showCmd != SW_SHOW) window->second.placement.showCmd = showCmd == SW_RESTORE ? SW_SHOWNORMAL : showCmd;
+        m_foreground = hwnd;
+    }
+
+    void ListFolderWindows(const HWND* skip, size_t skipCount, ExplorerFolderIndex& index) {
+        m_calls++;
+        for (HWND hwnd : m_folderWindows) {
+            if (skip && std::binary_search(skip, skip + skipCount, hwnd)) continue;
+            m_listed++;
+            index[hwnd] = m_windows.at(hwnd).folder;
+        }
+    }
+
+    // The window is created on top by a later wake of WaitForFolderWindows.
+    bool OpenFolder(const FolderId& folder, int) {
+        m_calls++;
+        UncountedScope uncounted;
+        m_opened.push_back(folder);
+        return true;
+    }
+
+    bool BeginFolderWatch() {
+        m_calls++;
+        return true;
+    }
+
+    // Each registration wakes the wait on its own, as on a real desktop.
+    bool WaitForFolderWindows(const std::function<bool()>& scan, DWORD) {
+        m_calls++;
+        while (!m_opened.empty()) {
+            {
+                UncountedScope uncounted;
+                HWND hwnd = AddWindow(SYNTHETIC_SHELL_PID, SYNTHETIC_FOLDER_CLASS, L"Folder", &m_opened.front());
+                m_opened.erase(m_opened.begin());
+                std::vector<HWND> order(1, hwnd);
+                for (HWND other : m_order) {
+                    if (other != hwnd) order.push_back(other);
+                }
+                SetOrder(order);
+            }
+            if (scan()) return true;
+        }
+        return false;
+    }
+
+    void EndFolderWatch() {
+        m_calls++;
+        m_opened.clear();
+    }
+
+private:
+    const SyntheticWindow* Find(HWND hwnd) const {
+        auto window = m_windows.find(hwnd);
+        return window == m_windows.end() ? NULL : &window->second;
+    }
+
+    static int CopyText(const wchar_t* source, wchar_t* text, int length) {
+        if (length <= 0) return 0;
+        wcsncpy_s(text, length, source, _TRUNCATE);
+        return (int)wcslen(text);
+    }
+
+    void SetOrder(std::vector<HWND>& order) {
+        m_order.swap(order);
+        m_position.clear();
+        for (size_t i = 0; i < m_order.size(); i++) m_position[m_order[i]] = i;
+    }
+
+    std::unordered_map<HWND, SyntheticWindow> m_windows;
+    std::vector<HWND> m_order;
+    std::unordered_map<HWND, size_t> m_position;
+    std::vector<HWND> m_folderWindows;
+    std::vector<FolderId> m_opened;
+    ULONG_PTR m_nextHwnd;
+    HWND m_foreground;
+    DWORD64 m_calls;
+    DWORD64 m_listed;
+};
+
+struct SyntheticPhase {
+    DWORD64 calls;
+    DWORD64 listed;
+    DWORD64 allocations;
+    double ms;
+};
+
+double ElapsedMs(const LARGE_INTEGER& start, const LARGE_INTEGER& frequency) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+}
+
+/*
+ * One capture and restore of a fresh desktop: appWindows ordinary windows
+ * from 16 processes, folderWindows Explorer windows stacked above them and
+ * the top folder window in the foreground. Counting down from the top, the
+ * second of every four folder windows is minimized and the third is on a
+ * second monitor.
+ */
+bool RunSyntheticIteration(const std::vector<FolderId>& folders, int appWindows, int folderWindows,
+    SyntheticPhase& capture, SyntheticPhase& restore) {
+    SyntheticDesktop desktop;
+    for (int i = folderWindows; i-- > 0;) {
+        HWND hwnd = desktop.AddWindow(SYNTHETIC_SHELL_PID, SYNTHETIC_FOLDER_CLASS, L"Folder", &folders[i]);
+        int fromTop = folderWindows - 1 - i;
+        if (fromTop % 4 == 1) desktop.SetShowCmd(hwnd, SW_SHOWMINIMIZED);
+        else if (fromTop % 4 == 2) desktop.SetMonitor(hwnd, SYNTHETIC_SECONDARY_MONITOR);
+    }
+    for (int i = 0; i < appWindows; i++) {
+        desktop.AddWindow(100 + i % 16, SYNTHETIC_APP_CLASS, L"Window " + std::to_wstring(i), NULL);
+    }
+    desktop.SetForeground(desktop.FirstWindow());
+    SetDesktopBackend(&desktop);
+
+    LARGE_INTEGER frequency, start;
+    QueryPerformanceFrequency(&frequency);
+
+    desktop.ResetCounters();
+    g_allocationCount = 0;
+    g_countAllocations = true;
+    QueryPerformanceCounter(&start);
+    std::vector<ExplorerWindow> windows = GetOpenExplorerWindows();
+    DesktopSnapshot snapshot = CaptureDesktopSnapshot();
+    std::vector<ExplorerWindow> deferred;
+    SplitDeferredExplorerWindows(windows, snapshot.foreground.hwnd, deferred);
+    capture.ms += ElapsedMs(start, frequency);
+    g_countAllocations = false;
+    capture.calls += desktop.Calls();
+    capture.listed += desktop.Listed();
+    capture.allocations += g_allocationCount;
+
+    desktop.DropFolderWindows();
+
+    desktop.ResetCounters();
+    g_allocationCount = 0;
+    g_countAllocations = true;
+    QueryPerformanceCounter(&start);
+    WindowRemap remap;
+    size_t restored = RestoreExplorerWindows(windows, remap);
+    RestoreDesktopSnapshot(snapshot, remap);
+    restored += RestoreDeferredExplorerWindows(deferred, snapshot, remap);
+    restore.ms += ElapsedMs(start, frequency);
+    g_countAllocations = false;
+    restore.calls += desktop.Calls();
+    restore.listed += desktop.Listed();
+    restore.allocations += g_allocationCount;
+
+    SetDesktopBackend(NULL);
+    size_t captured = windows.size() + deferred.size();
+    return captured == (size_t)folderWindows && restored == captured;
+}
+
+int RunSyntheticBenchmark(int iterations) {
+    const int appCounts[] = { 10, 100, 500 };
+    const int folderCounts[] = { 1, 10, 100 };
+
+    std::vector<FolderId> folders(100);
+    for (size_t i = 0; i < folders.size(); i++) {
+        wchar_t path[MAX_PATH];
+        swprintf_s(path, L"C:\\Synthetic\\Folder%Iu", i);
+        folders[i].Attach(SHSimpleIDListFromPath(path));
+        if (folders[i].Empty()) {
+            fwprintf(stderr, L"Could not create the synthetic folder IDs\n");
+            return 1;
+        }
+    }
+
+    wprintf(L"%-8s %-8s %-8s %12s %12s %10s %12s\n",
+        L"Windows", L"Folders", L"Phase", L"Calls", L"Listed", L"ms", L"Allocations");
+    int failures = 0;
+    for (int appWindows : appCounts) {
+        for (int folderWindows : folderCounts) {
+            SyntheticPhase capture = {};
+            SyntheticPhase restore = {};
+            for (int i = 0; i < iterations; i++) {
+                if (!RunSyntheticIteration(folders, appWindows, folderWindows, capture, restore)) failures++;
+            }
+            const SyntheticPhase* phases[] = { &capture, &restore };
+            const wchar_t* names[] = { L"capture", L"restore" };
+            for (int p = 0; p < 2; p++) {
+                wprintf(L"%-8d %-8d %-8s %12.0f %12.0f %10.3f %12.0f\n", appWindows, folderWindows, names[p],
+                    (double)phases[p]->calls / iterations, (double)phases[p]->listed / iterations,
+                    phases[p]->ms / iterations, (double)phases[p]->allocations / iterations);
+            }
+        }
+    }
+
+    if (failures > 0) wprintf(L"\n%d iterations did not restore every folder window\n", failures);
+    return failures > 0 ? 2 : 0;
+}